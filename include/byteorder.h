@@ -0,0 +1,59 @@
+/***************************************************************************/
+/*
+** ECM - Encoder for ECM (Error Code Modeler) format.
+** Version 1.0
+** Copyright (C) 2002 Neill Corlett
+** Copyright (c) 2020-2023 Azamat H. Hackimov
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+
+#ifndef ECM_BYTEORDER_H
+#define ECM_BYTEORDER_H
+
+#include <stdint.h>
+
+/*
+** Little-endian fields of ECM files, stores, container track tables and
+** the ecmd protocol. Kept in a header of its own so that the ecmd client
+** library can use it without the rest of unecm.h.
+*/
+
+static inline uint16_t get_le16(const uint8_t *p) {
+  return p[0] | ((uint16_t)p[1] << 8);
+}
+
+static inline uint32_t get_le32(const uint8_t *p) {
+  return ((uint32_t)p[0] << 0) | ((uint32_t)p[1] << 8) |
+         ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t get_le64(const uint8_t *p) {
+  return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static inline void put_le32(uint8_t *p, uint32_t v) {
+  p[0] = (v >> 0) & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+  p[2] = (v >> 16) & 0xFF;
+  p[3] = (v >> 24) & 0xFF;
+}
+
+static inline void put_le64(uint8_t *p, uint64_t v) {
+  put_le32(p, (uint32_t)v);
+  put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+#endif
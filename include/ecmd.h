@@ -0,0 +1,105 @@
+/***************************************************************************/
+/*
+** ECMD - Sector server for ECM (Error Code Modeler) files.
+** Version 1.0
+** Copyright (C) 2002 Neill Corlett
+** Copyright (c) 2020-2023 Azamat H. Hackimov
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+
+#ifndef ECM_ECMD_H
+#define ECM_ECMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+** Protocol: every request and every response starts with a 24-byte header,
+** all values little-endian.
+**
+** Request:  4 bytes op, 4 bytes handle, 8 bytes offset, 4 bytes length,
+**           4 bytes flags
+** Response: 4 bytes status (0, or an errno value), 4 bytes handle,
+**           8 bytes value, 4 bytes length, 4 bytes flags
+**
+** ECMD_OPEN is followed by length bytes of path; the response has the new
+** handle and the size of the original file in value. ECMD_READ reads
+** length bytes at offset of the original file (fewer at its end); the
+** response is followed by the data, or carries a shared memory file
+** descriptor holding it if ECMD_FLAG_FD is set in its flags. ECMD_CLOSE
+** closes a handle.
+*/
+#define ECMD_OPEN 1
+#define ECMD_READ 2
+#define ECMD_CLOSE 3
+
+#define ECMD_HEADER_SIZE 24
+
+/* Request: always answer with a descriptor; response: data is in one */
+#define ECMD_FLAG_FD 0x01
+
+/* Reads larger than this are answered with a descriptor where possible */
+#define ECMD_INLINE_MAX 0x10000
+/* Largest read in one request */
+#define ECMD_READ_MAX 0x4000000
+/* Longest path for ECMD_OPEN */
+#define ECMD_PATH_MAX 4096
+
+/* Bytes per sector for ecmd_read_sectors() */
+#define ECMD_SECTOR_SIZE 2352
+
+/* A connection to ecmd; not to be shared between threads */
+struct ecmd_client;
+
+/* Connect to the daemon listening on socketpath, NULL on failure */
+struct ecmd_client *ecmd_connect(const char *socketpath);
+
+/* Close a connection and all handles opened on it */
+void ecmd_disconnect(struct ecmd_client *client);
+
+/*
+** Open an ECM file (a path as seen by the daemon). Returns a handle, or -1
+** with errno set. The size of the original file goes to size if not NULL.
+*/
+int ecmd_open(struct ecmd_client *client, const char *path, uint64_t *size);
+
+/* Close a handle, returns 0 or -1 with errno set */
+int ecmd_close(struct ecmd_client *client, int handle);
+
+/*
+** Read size bytes of the original file at offset. Returns the number of
+** bytes read (fewer at the end of the file), or -1 with errno set.
+*/
+long ecmd_read(struct ecmd_client *client, int handle, uint64_t offset,
+               void *buf, size_t size);
+
+/* Read count 2352-byte sectors starting at lba, returns sectors read */
+long ecmd_read_sectors(struct ecmd_client *client, int handle, uint32_t lba,
+                       unsigned count, void *buf);
+
+/*
+** Map size bytes of the original file at offset without copying them
+** through the socket. Returns the mapping (read-only) and its length in
+** *got, or NULL with errno set (0 at the end of the file, where *got is
+** 0 as well). Release it with ecmd_unmap().
+*/
+const void *ecmd_map(struct ecmd_client *client, int handle, uint64_t offset,
+                     size_t size, size_t *got);
+
+/* Release a mapping from ecmd_map() */
+void ecmd_unmap(const void *data, size_t size);
+
+#endif //ECM_ECMD_H
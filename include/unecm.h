@@ -24,16 +24,45 @@
 #define ECM_UNECM_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+#include "byteorder.h"
 
 #if defined(WIN32) || defined(WIN64)
 #define strcasecmp _stricmp
+#define strncasecmp _strnicmp
 #endif
 
 // Sector 1 (0x930)
 #define SECTOR_1_SIZE 2352
 // Can be sector 2 and 3 (0x920)
 #define SECTOR_2_SIZE 2336
+// Shortest literal run worth handing to the kernel
+#define LITERAL_PASSTHROUGH_MIN 0x100000
+
+// Flags in the fourth byte of the magic identifier
+#define ECM_FLAG_FRAMED 0x01
+#define ECM_FLAG_STORE 0x02
+
+// Most bytes or sectors a single type/count record can hold
+#define ECM_RUN_MAX 0x7FFFFFFF
+
+// Sector stores: reference to an entry (SHA-1 key, LE64 entry offset)
+#define STORE_KEY_SIZE 20
+#define STORE_REF_SIZE 28
+
+// Framed files: header size and default output bytes per frame
+#define ECM_FRAME_HEADER_SIZE 28
+#define ECM_FRAME_SIZE 0x1000000
+
+/* Header of a frame in a framed ECM file */
+struct ecm_frame {
+  uint64_t outoffset; /* Offset of the frame in the decoded file */
+  uint32_t outbytes;  /* Decoded bytes in the frame */
+  uint32_t encbytes;  /* Bytes of records following the header */
+  uint32_t crc;       /* CRC-32 of the decoded bytes */
+};
 
 /* Init routine */
 void eccedc_init(void);
@@ -42,6 +71,9 @@ void eccedc_init(void);
 uint32_t edc_partial_computeblock(uint32_t edc, const uint8_t *src,
                                   uint16_t size);
 
+/* Compute CRC-32 (as used by zip) for a block */
+uint32_t crc32_computeblock(uint32_t crc, const uint8_t *src, size_t size);
+
 /* Compute ECC for a block (can do either P or Q) */
 bool ecc_computeblock_encode(uint8_t *src, uint32_t major_count,
                              uint32_t minor_count, uint32_t major_mult,
@@ -57,6 +89,253 @@ int ecc_generate_encode(uint8_t *sector, bool zeroaddress, uint8_t *dest);
 /* Generate ECC P and Q codes for a block */
 void ecc_generate_decode(uint8_t *sector, bool zeroaddress);
 
+/* Generate ECC/EDC information for a sector of a type */
+void eccedc_generate(uint8_t *sector, int type);
+
+/* Rebuild a sector of a type from its payload in a plain ECM file */
+void sector_rebuild(uint8_t *sector, unsigned type, const uint8_t *payload);
+
+
+/* A run of equally sized sectors taken from a container's track table */
+struct track_region {
+  uint64_t start;    /* Offset of the first sector in the image */
+  uint64_t end;      /* End of the track in the image */
+  unsigned stride;   /* Bytes per sector in the image, with subchannel */
+  unsigned datasize; /* SECTOR_1_SIZE, SECTOR_2_SIZE, or 0 if all literal */
+};
+
+/* Sorted, non-overlapping tracks of an image */
+struct track_map {
+  struct track_region *region;
+  size_t n;
+};
+
+/* What track_hint() wants done at a position */
+#define TRACK_SCAN 0    /* Not inside a known track, scan as usual */
+#define TRACK_CHECK 1   /* A sector starts here, check_type() it */
+#define TRACK_LITERAL 2 /* Literal bytes up to the next sector */
+
+/* Read a type/count combo, returns 0 on success and 1 on EOF */
+int read_type_count(FILE *in, unsigned *type, unsigned *num);
+
+/* Bytes stored in the ECM file per sector (or literal byte) of a type */
+unsigned record_payload_size(unsigned type);
+
+/* Bytes of the original file per sector (or literal byte) of a type */
+unsigned record_output_size(unsigned type);
+
+/* Build a frame header (ECM_FRAME_HEADER_SIZE bytes) */
+void frame_header_pack(uint8_t *header, const struct ecm_frame *frame);
+
+/* Parse a frame header, returns false if it is not a valid one */
+bool frame_header_unpack(const uint8_t *header, struct ecm_frame *frame);
+
+/* Hashes of the original image */
+#define HASH_CRC32 0x01
+#define HASH_MD5 0x02
+#define HASH_SHA1 0x04
+
+struct image_digest {
+  unsigned which; /* HASH_* that were computed */
+  uint64_t size;
+  uint32_t crc32;
+  uint8_t md5[16];
+  uint8_t sha1[20];
+};
+
+/* Start hashing everything passed to image_hash() */
+bool image_hash_begin(unsigned which);
+
+/* Hash the next bytes of the original image (no-op if not hashing) */
+void image_hash(const uint8_t *data, size_t size);
+
+/* Stop hashing; returns false if image_hash_begin() was not called */
+bool image_hash_end(struct image_digest *digest);
+
+/* SHA-1 of a block of memory */
+void sha1_compute(const uint8_t *data, size_t size, uint8_t *digest);
+
+/* Parse a list like "crc32,md5,sha1" or "all", returns 0 if invalid */
+unsigned hash_parse(const char *list);
+
+/* Print a digest as a DAT <rom> entry */
+void digest_print(FILE *f, const char *name, const struct image_digest *d);
+
+/* Look up a digest in a DAT file, returns 0 if some entry matches */
+int dat_check(const char *datfile, const struct image_digest *d);
+
+/* Shared sector store, see store.c */
+struct sector_store;
+
+/*
+** Open a store to add sectors to, creating it if needed; waits for any other
+** writer to close it first
+*/
+struct sector_store *store_open_write(const char *filename);
+
+/* Open a store to read sectors from */
+struct sector_store *store_open_read(const char *filename);
+
+/* Add size bytes of data unless already present, and write its reference */
+bool store_put(struct sector_store *store, const uint8_t *data, uint32_t size,
+               uint8_t *ref);
+
+/* Look up a reference, returns NULL if the store does not have it */
+const uint8_t *store_get(struct sector_store *store, const uint8_t *ref,
+                         uint32_t size);
+
+/* Write out and fsync everything added so far, returns false on failure */
+bool store_sync(struct sector_store *store);
+
+/* File name and size in bytes (including anything not written yet) */
+const char *store_name(const struct sector_store *store);
+uint64_t store_size(const struct sector_store *store);
+
+/* Close a store, returns false if anything added could not be written */
+bool store_close(struct sector_store *store);
+
+/* Bytes stored per sector of a type in files with ECM_FLAG_STORE */
+unsigned record_ref_size(unsigned type);
+
+/* Bytes of a sector of a type that go to the store */
+unsigned record_store_size(unsigned type);
+
+/* A record of an ECM file, see index.c */
+struct ecm_record {
+  uint64_t outoffset; /* Offset of its first byte in the original file */
+  uint64_t inoffset;  /* Offset of its payload in the ECM file */
+  uint32_t count;     /* Sectors, or literal bytes */
+  unsigned type;
+};
+
+/* Record map of an ECM file */
+struct ecm_index {
+  struct ecm_record *record;
+  size_t n;
+  size_t allocated;
+  uint64_t size; /* Size of the original file */
+  unsigned flags;
+  uint32_t edc; /* EDC of the original file */
+};
+
+/* Random access to an ECM file: read size bytes at offset */
+struct ecm_source {
+  bool (*read)(void *ctx, uint64_t offset, uint8_t *buf, size_t size);
+  void *ctx;
+};
+
+/* Build the record map of an ECM file, returns false if it is damaged */
+bool ecm_index_build(FILE *in, struct ecm_index *index);
+
+/* Free a record map */
+void ecm_index_free(struct ecm_index *index);
+
+/* Bytes in the ECM file per sector (or literal byte) of a type */
+unsigned ecm_index_payload_size(const struct ecm_index *index, unsigned type);
+
+/* Record holding a byte of the original file, or NULL if past the end */
+const struct ecm_record *ecm_index_find(const struct ecm_index *index,
+                                        uint64_t offset);
+
+/*
+** Read the payload of sector k of a record, as it would be in a plain ECM
+** file (looking it up in store if needed)
+*/
+bool ecm_index_payload(const struct ecm_index *index,
+                       const struct ecm_source *source,
+                       struct sector_store *store, const struct ecm_record *r,
+                       uint32_t k, uint8_t *payload);
+
+/* Rebuild size bytes of the original file at offset */
+bool ecm_index_read(const struct ecm_index *index,
+                    const struct ecm_source *source,
+                    struct sector_store *store, uint64_t offset, uint8_t *buf,
+                    size_t size);
+
+/* Input (encode) or output (decode) bytes between checkpoints */
+#define CHECKPOINT_INTERVAL 0x4000000
+/* Longest store file name a checkpoint keeps */
+#define CHECKPOINT_PATH_MAX 4096
+
+/* State of an encode or decode between two records, see checkpoint.c */
+struct checkpoint {
+  uint64_t insize; /* Size of the input file */
+  uint64_t in;     /* Input offset to go on from */
+  uint64_t out;    /* Output bytes that are done */
+  uint32_t edc;    /* EDC of the original file so far */
+  unsigned flags;  /* ECM_FLAG_* of the ECM file */
+  /* Encode: header position (-1 if none) and state of the open frame */
+  int64_t frameheader;
+  struct ecm_frame frame;
+  uint64_t count[4]; /* Encode: literal bytes and sectors of each type */
+  /* Encode: type (-1 if none), input offset and length of the open run */
+  int runtype;
+  uint64_t runstart;
+  uint64_t runcount;
+  unsigned bad;      /* Decode: bad frames so far */
+  uint32_t tail;     /* CRC-32 of the output bytes just before out */
+  /* Identity of the input file, see checkpoint_identify() */
+  uint64_t mtime;
+  uint64_t inode;
+  bool container;    /* Encode: a container track table is used */
+  uint64_t storesize; /* Store bytes the output may refer to */
+  char store[CHECKPOINT_PATH_MAX]; /* Store file name, empty if none */
+};
+
+/* Write <outfilename>.ckpt; the output must be synced (file_sync) */
+bool checkpoint_save(const char *outfilename, struct checkpoint *c);
+
+/* Read <outfilename>.ckpt and check it against the output file */
+bool checkpoint_load(const char *outfilename, struct checkpoint *c);
+
+/* Note the identity of the input file and the store (may be NULL) in c */
+bool checkpoint_identify(struct checkpoint *c, FILE *in,
+                         struct sector_store *store);
+
+/* Check that c was taken with the same input file and store */
+bool checkpoint_matches(const struct checkpoint *c, FILE *in,
+                        struct sector_store *store);
+
+/* Remove <outfilename>.ckpt */
+void checkpoint_remove(const char *outfilename);
+
+/* Flush a file and get it onto the disk */
+bool file_sync(FILE *f);
+
+/* Cut a file back to size bytes */
+bool file_truncate(FILE *f, uint64_t size);
+
+/* Detect the type of the sector (0 means literal) */
+int check_type(unsigned char *sector, bool canbetype1);
+
+/*
+** Read the track table of a known container format into map. Returns the
+** name of the format, or NULL if filename is not a known container.
+*/
+const char *container_tracks(const char *filename, struct track_map *map);
+
+/* Free a track map */
+void container_free(struct track_map *map);
+
+/*
+** Look up pos (with avail bytes at data) in the track map. On TRACK_CHECK,
+** canbetype1 tells which check to make and count is how many literal bytes
+** to emit if the check fails; on TRACK_LITERAL, count is how many literal
+** bytes to emit.
+*/
+int track_hint(const struct track_map *map, uint64_t pos, const uint8_t *data,
+               uint64_t avail, uint64_t *count, bool *canbetype1);
+
+/* Dry-run an encode of filename and report what it would produce */
+int analyze(const char *filename, unsigned threads, bool json,
+            bool tracks);
+
+/*
+** Compare the original files of two ECM files and report where they
+** differ. Returns 0 if they are the same, 1 if not, 2 on trouble.
+*/
+int ecm_diff(const char *afilename, const char *bfilename,
+             const char *storefilename);
 
 /* Reset all counters */
 void resetcounter(unsigned total);
@@ -70,4 +349,13 @@ void setcounter_encode(unsigned n);
 /* Set counters on decode */
 void setcounter_decode(unsigned n);
 
+/*
+** Copy a literal run of count bytes from in to out in kernel space and
+** update edc (and crc, if not NULL). Returns false (without consuming
+** anything) if the run is too short, either side is not a regular file or
+** the platform lacks support.
+*/
+bool literal_passthrough(FILE *in, FILE *out, unsigned count, unsigned *edc,
+                         uint32_t *crc);
+
 #endif //ECM_UNECM_H
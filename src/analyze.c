@@ -0,0 +1,415 @@
+/***************************************************************************/
+/*
+** ECM - Encoder for ECM (Error Code Modeler) format.
+** Version 1.0
+** Copyright (C) 2002 Neill Corlett
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+/*
+** Dry-run analysis: classify an image the same way ecmify() does, without
+** writing anything, and predict the size of the resulting ECM file.
+**
+** The classifier only looks at the bytes at the current position, so the
+** walk from any given position is always the same. The input is split into
+** chunks that are walked in parallel from their first byte; the chunks are
+** then stitched together by continuing the real walk into each chunk until
+** it lands on a position that the chunk's own walk also visited.
+*/
+/***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unecm.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Chunks smaller than this are not worth a thread */
+#define ANALYZE_CHUNK_MIN 0x1000000
+
+/* A run of same-typed steps; count is bytes for type 0, sectors otherwise */
+struct analyze_run {
+  uint64_t start;
+  uint64_t count;
+  int type;
+};
+
+struct analyze_runs {
+  struct analyze_run *run;
+  size_t n;
+  size_t size;
+};
+
+struct analyze_chunk {
+  uint64_t start;
+  uint64_t end;
+  /* Position where the chunk's own walk stopped (>= end) */
+  uint64_t stop;
+  struct analyze_runs runs;
+};
+
+struct analyze_job {
+  const uint8_t *map;
+  uint64_t total;
+  const struct track_map *tracks;
+  struct analyze_chunk *chunk;
+  size_t chunks;
+  size_t next;
+  pthread_mutex_t lock;
+};
+
+/* Bytes taken by an encoded type/count combo (see write_type_count()) */
+static unsigned type_count_size(uint64_t count) {
+  unsigned n = 1;
+  count = (count - 1) >> 5;
+  while (count) {
+    n++;
+    count >>= 7;
+  }
+  return n;
+}
+
+/*
+** Same decision as ecmify() makes at this position; step is set to the
+** number of bytes the walk moves on
+*/
+static int analyze_type(const struct analyze_job *job, uint64_t pos,
+                        uint64_t *step) {
+  uint8_t sector[4 + SECTOR_1_SIZE];
+  const uint8_t *p = job->map + pos;
+  uint64_t avail = job->total - pos;
+  uint64_t literal;
+  bool canbetype1 = false;
+  int hint, type;
+  hint = track_hint(job->tracks, pos, p, avail, &literal, &canbetype1);
+  *step = 1;
+  if (hint == TRACK_LITERAL) {
+    *step = literal;
+    return 0;
+  }
+  if (hint == TRACK_SCAN) {
+    if (avail < SECTOR_2_SIZE)
+      return 0;
+    /* Cheap reject before copying; check_type() would bail out as well */
+    if ((p[0] != p[4]) || (p[1] != p[5]) || (p[2] != p[6]) || (p[3] != p[7]))
+      return 0;
+  }
+  /* check_type() scribbles (and restores) around the sector, so copy it */
+  memset(sector, 0, 4);
+  memcpy(sector + 4, p, canbetype1 ? SECTOR_1_SIZE : SECTOR_2_SIZE);
+  type = check_type(sector + 4, canbetype1);
+  if (type)
+    *step = record_output_size(type);
+  else if (hint == TRACK_CHECK)
+    *step = literal;
+  return type;
+}
+
+static bool runs_append(struct analyze_runs *runs, uint64_t start, int type,
+                        uint64_t count) {
+  struct analyze_run *last = runs->n ? &runs->run[runs->n - 1] : NULL;
+  if (last && (last->type == type) &&
+      (last->start + last->count * record_output_size(type) == start)) {
+    last->count += count;
+    return true;
+  }
+  if (runs->n == runs->size) {
+    size_t size = runs->size ? runs->size * 2 : 1024;
+    struct analyze_run *run = realloc(runs->run, size * sizeof(*run));
+    if (!run)
+      return false;
+    runs->run = run;
+    runs->size = size;
+  }
+  runs->run[runs->n].start = start;
+  runs->run[runs->n].type = type;
+  runs->run[runs->n].count = count;
+  runs->n++;
+  return true;
+}
+
+static void *analyze_thread(void *arg) {
+  struct analyze_job *job = arg;
+  for (;;) {
+    struct analyze_chunk *chunk;
+    uint64_t pos;
+    pthread_mutex_lock(&job->lock);
+    if (job->next == job->chunks) {
+      pthread_mutex_unlock(&job->lock);
+      return NULL;
+    }
+    chunk = &job->chunk[job->next++];
+    pthread_mutex_unlock(&job->lock);
+    pos = chunk->start;
+    while (pos < chunk->end) {
+      uint64_t step;
+      int type = analyze_type(job, pos, &step);
+      if (!runs_append(&chunk->runs, pos, type, type ? 1 : step))
+        return (void *)1;
+      pos += step;
+    }
+    chunk->stop = pos;
+  }
+}
+
+/*
+** If the chunk's walk stepped on pos, append everything it found from pos
+** onwards to runs and return true
+*/
+static bool analyze_join(struct analyze_runs *runs,
+                         const struct analyze_chunk *chunk, uint64_t pos,
+                         bool *ok) {
+  size_t lo = 0, hi = chunk->runs.n, i;
+  const struct analyze_run *run;
+  uint64_t skip;
+  /* Last run starting at or before pos */
+  while (hi - lo > 1) {
+    size_t mid = (lo + hi) / 2;
+    if (chunk->runs.run[mid].start <= pos)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  if (!chunk->runs.n || (chunk->runs.run[lo].start > pos))
+    return false;
+  run = &chunk->runs.run[lo];
+  skip = pos - run->start;
+  if ((skip % record_output_size(run->type)) ||
+      (skip / record_output_size(run->type) >= run->count))
+    return false;
+  skip /= record_output_size(run->type);
+  *ok = runs_append(runs, pos, run->type, run->count - skip);
+  for (i = lo + 1; *ok && (i < chunk->runs.n); i++)
+    *ok = runs_append(runs, chunk->runs.run[i].start, chunk->runs.run[i].type,
+                      chunk->runs.run[i].count);
+  return true;
+}
+
+static void print_report(FILE *f, const char *filename, uint64_t total,
+                         const char *container,
+                         const struct analyze_runs *runs, unsigned threads,
+                         double seconds, bool json) {
+  uint64_t tally[4] = {0, 0, 0, 0};
+  uint64_t size = 4;
+  uint64_t shortbytes = 0;
+  size_t shortruns = 0;
+  size_t i;
+  bool first = true;
+  for (i = 0; i < runs->n; i++) {
+    const struct analyze_run *run = &runs->run[i];
+    uint64_t rest = run->count % ECM_RUN_MAX;
+    tally[run->type] += run->count;
+    /* The encoder splits runs into records of at most ECM_RUN_MAX */
+    size += (run->count / ECM_RUN_MAX) * type_count_size(ECM_RUN_MAX) +
+            (rest ? type_count_size(rest) : 0) +
+            run->count * record_payload_size(run->type);
+  }
+  /* End-of-records indicator and EDC */
+  size += 5 + 4;
+  if (json) {
+    fprintf(f, "{\n  \"file\": \"");
+    for (; *filename; filename++) {
+      if ((*filename == '"') || (*filename == '\\'))
+        fputc('\\', f);
+      fputc(*filename, f);
+    }
+    fprintf(f, "\",\n");
+    fprintf(f, "  \"input_bytes\": %llu,\n", (unsigned long long)total);
+    if (container)
+      fprintf(f, "  \"container\": \"%s\",\n", container);
+    else
+      fprintf(f, "  \"container\": null,\n");
+    fprintf(f, "  \"literal_bytes\": %llu,\n", (unsigned long long)tally[0]);
+    fprintf(f, "  \"mode1_sectors\": %llu,\n", (unsigned long long)tally[1]);
+    fprintf(f, "  \"mode2_form1_sectors\": %llu,\n",
+            (unsigned long long)tally[2]);
+    fprintf(f, "  \"mode2_form2_sectors\": %llu,\n",
+            (unsigned long long)tally[3]);
+    fprintf(f, "  \"records\": %llu,\n", (unsigned long long)runs->n);
+    fprintf(f, "  \"estimated_ecm_bytes\": %llu,\n", (unsigned long long)size);
+    fprintf(f, "  \"literal_ranges\": [");
+    for (i = 0; i < runs->n; i++) {
+      if (runs->run[i].type)
+        continue;
+      fprintf(f, "%s\n    [%llu, %llu]", first ? "" : ",",
+              (unsigned long long)runs->run[i].start,
+              (unsigned long long)runs->run[i].count);
+      first = false;
+    }
+    fprintf(f, "%s],\n", first ? "" : "\n  ");
+    fprintf(f, "  \"threads\": %u,\n", threads);
+    fprintf(f, "  \"seconds\": %.3f\n}\n", seconds);
+    return;
+  }
+  if (container)
+    fprintf(f, "Container............... %10s\n", container);
+  fprintf(f, "Literal bytes........... %10llu\n", (unsigned long long)tally[0]);
+  fprintf(f, "Mode 1 sectors.......... %10llu\n", (unsigned long long)tally[1]);
+  fprintf(f, "Mode 2 form 1 sectors... %10llu\n", (unsigned long long)tally[2]);
+  fprintf(f, "Mode 2 form 2 sectors... %10llu\n", (unsigned long long)tally[3]);
+  fprintf(f, "Literal ranges (offset, length):\n");
+  for (i = 0; i < runs->n; i++) {
+    if (runs->run[i].type)
+      continue;
+    /* Sector headers in front of mode 2 sectors are only summarized */
+    if (runs->run[i].count < SECTOR_2_SIZE) {
+      shortruns++;
+      shortbytes += runs->run[i].count;
+      continue;
+    }
+    fprintf(f, "  %12llu %12llu\n", (unsigned long long)runs->run[i].start,
+            (unsigned long long)runs->run[i].count);
+  }
+  if (shortruns)
+    fprintf(f, "  ...and %llu shorter ranges totalling %llu bytes\n",
+            (unsigned long long)shortruns, (unsigned long long)shortbytes);
+  fprintf(f, "Estimated %llu bytes -> %llu bytes\n", (unsigned long long)total,
+          (unsigned long long)size);
+  fprintf(f, "Analyzed in %.3f seconds (%u threads)\n", seconds, threads);
+}
+
+int analyze(const char *filename, unsigned threads, bool json,
+            bool tracks) {
+  struct analyze_job job;
+  struct track_map trackmap;
+  const char *container = NULL;
+  struct analyze_runs runs = {NULL, 0, 0};
+  struct timespec t0, t1;
+  struct stat st;
+  pthread_t *thread = NULL;
+  uint64_t chunksize, pos;
+  unsigned started = 0;
+  uint8_t *map = NULL;
+  int fd, r = 1;
+  size_t i;
+  bool ok = true;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  memset(&job, 0, sizeof(job));
+  fd = open(filename, O_RDONLY);
+  if ((fd < 0) || fstat(fd, &st)) {
+    perror(filename);
+    if (fd >= 0)
+      close(fd);
+    return 1;
+  }
+  job.total = st.st_size;
+  if (job.total) {
+    map = mmap(NULL, job.total, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+      perror(filename);
+      close(fd);
+      return 1;
+    }
+    madvise(map, job.total, MADV_SEQUENTIAL);
+  }
+  job.map = map;
+  if (tracks)
+    container = container_tracks(filename, &trackmap);
+  job.tracks = container ? &trackmap : NULL;
+  if (!threads) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = n > 0 ? n : 1;
+  }
+  /* A few chunks per thread so that a slow chunk does not hold up the rest */
+  chunksize = job.total / (threads * 4) + 1;
+  if (chunksize < ANALYZE_CHUNK_MIN)
+    chunksize = ANALYZE_CHUNK_MIN;
+  job.chunks = (job.total + chunksize - 1) / chunksize;
+  if (threads > job.chunks)
+    threads = job.chunks ? job.chunks : 1;
+  job.chunk = calloc(job.chunks ? job.chunks : 1, sizeof(*job.chunk));
+  thread = calloc(threads, sizeof(*thread));
+  if (!job.chunk || !thread)
+    abort();
+  for (i = 0; i < job.chunks; i++) {
+    job.chunk[i].start = i * chunksize;
+    job.chunk[i].end = job.chunk[i].start + chunksize;
+    if (job.chunk[i].end > job.total)
+      job.chunk[i].end = job.total;
+  }
+  pthread_mutex_init(&job.lock, NULL);
+  for (; started < threads; started++)
+    if (pthread_create(&thread[started], NULL, analyze_thread, &job))
+      break;
+  if (!started)
+    analyze_thread(&job);
+  for (i = 0; i < started; i++) {
+    void *ret;
+    pthread_join(thread[i], &ret);
+    if (ret)
+      ok = false;
+  }
+  pthread_mutex_destroy(&job.lock);
+  /* Stitch the chunks together following the real walk */
+  pos = 0;
+  for (i = 0; ok && (i < job.chunks); i++) {
+    while (ok && (pos < job.chunk[i].end)) {
+      uint64_t step;
+      int type;
+      if (analyze_join(&runs, &job.chunk[i], pos, &ok)) {
+        pos = job.chunk[i].stop;
+        break;
+      }
+      type = analyze_type(&job, pos, &step);
+      ok = runs_append(&runs, pos, type, type ? 1 : step);
+      pos += step;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  if (ok) {
+    print_report(stdout, filename, job.total, container, &runs,
+                 started ? started : 1,
+                 (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9,
+                 json);
+    r = 0;
+  } else {
+    fprintf(stderr, "Out of memory\n");
+  }
+  for (i = 0; i < job.chunks; i++)
+    free(job.chunk[i].runs.run);
+  free(job.chunk);
+  free(thread);
+  free(runs.run);
+  if (container)
+    container_free(&trackmap);
+  if (map)
+    munmap(map, job.total);
+  close(fd);
+  return r;
+}
+
+#else
+
+int analyze(const char *filename, unsigned threads, bool json,
+            bool tracks) {
+  (void)filename;
+  (void)threads;
+  (void)json;
+  (void)tracks;
+  fprintf(stderr, "--analyze is not supported on this platform\n");
+  return 1;
+}
+
+#endif
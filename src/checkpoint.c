@@ -0,0 +1,254 @@
+/***************************************************************************/
+/*
+** ECM - Encoder for ECM (Error Code Modeler) format.
+** Version 1.0
+** Copyright (C) 2002 Neill Corlett
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+/*
+** Checkpoints of encodes and decodes, so that an interrupted run can be
+** resumed instead of starting over.
+**
+** A checkpoint is taken between two records of the output and kept next
+** to the output file as <output>.ckpt, a short text file. An encode also
+** notes the run it is in the middle of; that run is only written once it
+** ends, so the ECM file comes out the same as without checkpoints.
+**
+** The checkpoint is written to a temporary file first and renamed over
+** the old one, so there is always one whole checkpoint. It holds a CRC-32
+** of the last output bytes it covers; on resume those are checked against
+** the output file, which is then cut back to where the checkpoint was
+** taken. It also notes what the run was started with: the input file (its
+** modification time and inode), the store and how big it was, and for an
+** encode whether a container track table was used. A resume with
+** anything else is refused.
+*/
+/***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unecm.h"
+
+#include <sys/stat.h>
+#if defined(WIN32) || defined(WIN64)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+/* Output bytes before the checkpoint that are checked on resume */
+#define CHECKPOINT_TAIL 0x10000
+
+static char *checkpoint_name(const char *outfilename, const char *suffix) {
+  char *name = malloc(strlen(outfilename) + strlen(suffix) + 1);
+  if (!name)
+    abort();
+  sprintf(name, "%s%s", outfilename, suffix);
+  return name;
+}
+
+/*
+** CRC-32 of the CHECKPOINT_TAIL bytes (or fewer) before c->out. The header
+** of an open frame is left out, it is only filled in when the frame ends.
+*/
+static bool checkpoint_tail(const char *outfilename,
+                            const struct checkpoint *c, uint32_t *crc) {
+  uint8_t buf[CHECKPOINT_TAIL];
+  uint64_t start = c->out < sizeof(buf) ? 0 : c->out - sizeof(buf);
+  size_t n = c->out - start;
+  FILE *f = fopen(outfilename, "rb");
+  bool ok;
+  int64_t i;
+  if (!f)
+    return false;
+  ok = !fseek(f, (long)start, SEEK_SET) && (fread(buf, 1, n, f) == n);
+  fclose(f);
+  if (c->frameheader >= 0)
+    for (i = c->frameheader; i < c->frameheader + ECM_FRAME_HEADER_SIZE; i++)
+      if ((i >= (int64_t)start) && (i < (int64_t)c->out))
+        buf[i - start] = 0;
+  *crc = crc32_computeblock(0, buf, n);
+  return ok;
+}
+
+bool checkpoint_save(const char *outfilename, struct checkpoint *c) {
+  char *tmpname = checkpoint_name(outfilename, ".ckpt.tmp");
+  char *name = checkpoint_name(outfilename, ".ckpt");
+  FILE *f;
+  bool ok = false;
+  if (!checkpoint_tail(outfilename, c, &c->tail))
+    goto done;
+  f = fopen(tmpname, "w");
+  if (!f)
+    goto done;
+  fprintf(f,
+          "ECMCKPT 1\n"
+          "insize %llu\nin %llu\nout %llu\nedc %lu\nflags %u\n"
+          "frameheader %lld\nframeoffset %llu\nframebytes %lu\n"
+          "framecrc %lu\ncount %llu %llu %llu %llu\nrun %d %llu %llu\n"
+          "bad %u\ntail %lu\ninput %llu %llu\ncontainer %u\nstore %llu\n"
+          "%s\n",
+          (unsigned long long)c->insize, (unsigned long long)c->in,
+          (unsigned long long)c->out, (unsigned long)c->edc, c->flags,
+          (long long)c->frameheader,
+          (unsigned long long)c->frame.outoffset,
+          (unsigned long)c->frame.outbytes, (unsigned long)c->frame.crc,
+          (unsigned long long)c->count[0], (unsigned long long)c->count[1],
+          (unsigned long long)c->count[2], (unsigned long long)c->count[3],
+          c->runtype, (unsigned long long)c->runstart,
+          (unsigned long long)c->runcount, c->bad, (unsigned long)c->tail,
+          (unsigned long long)c->mtime, (unsigned long long)c->inode,
+          (unsigned)c->container, (unsigned long long)c->storesize,
+          c->store);
+  /* The new checkpoint must be on disk before it replaces the old one */
+  ok = file_sync(f) && !ferror(f);
+  ok = !fclose(f) && ok;
+#if defined(WIN32) || defined(WIN64)
+  /* rename() does not replace an existing file on Windows */
+  remove(name);
+#endif
+  ok = ok && !rename(tmpname, name);
+done:
+  if (!ok)
+    fprintf(stderr, "Could not write checkpoint %s\n", name);
+  free(tmpname);
+  free(name);
+  return ok;
+}
+
+bool checkpoint_load(const char *outfilename, struct checkpoint *c) {
+  char *name = checkpoint_name(outfilename, ".ckpt");
+  unsigned long long insize, in, out, frameoffset, count[4];
+  unsigned long long runstart, runcount, mtime, inode, storesize;
+  unsigned container;
+  size_t len;
+  unsigned long edc, framebytes, framecrc, tail;
+  long long frameheader;
+  uint32_t crc;
+  FILE *f = fopen(name, "r");
+  int n;
+  if (!f) {
+    perror(name);
+    free(name);
+    return false;
+  }
+  n = fscanf(f,
+             "ECMCKPT 1 insize %llu in %llu out %llu edc %lu flags %u "
+             "frameheader %lld frameoffset %llu framebytes %lu "
+             "framecrc %lu count %llu %llu %llu %llu run %d %llu %llu "
+             "bad %u tail %lu input %llu %llu container %u store %llu",
+             &insize, &in, &out, &edc, &c->flags, &frameheader,
+             &frameoffset, &framebytes, &framecrc, &count[0], &count[1],
+             &count[2], &count[3], &c->runtype, &runstart, &runcount,
+             &c->bad, &tail, &mtime, &inode, &container, &storesize);
+  /* The store file name is the rest of the file, on a line of its own */
+  c->store[0] = 0;
+  if ((n == 22) &&
+      ((fgetc(f) != '\n') || !fgets(c->store, sizeof(c->store), f)))
+    n = 0;
+  fclose(f);
+  len = strlen(c->store);
+  if (len && (c->store[len - 1] == '\n'))
+    c->store[len - 1] = 0;
+  if ((n != 22) || (c->runtype < -1) || (c->runtype > 3)) {
+    fprintf(stderr, "%s: not a valid checkpoint\n", name);
+    free(name);
+    return false;
+  }
+  free(name);
+  c->insize = insize;
+  c->in = in;
+  c->out = out;
+  c->edc = edc;
+  c->frameheader = frameheader;
+  c->frame.outoffset = frameoffset;
+  c->frame.outbytes = framebytes;
+  c->frame.encbytes = 0;
+  c->frame.crc = framecrc;
+  for (n = 0; n < 4; n++)
+    c->count[n] = count[n];
+  c->runstart = runstart;
+  c->runcount = runcount;
+  c->tail = tail;
+  c->mtime = mtime;
+  c->inode = inode;
+  c->container = container;
+  c->storesize = storesize;
+  if (!checkpoint_tail(outfilename, c, &crc) || (crc != c->tail)) {
+    fprintf(stderr, "%s does not match its checkpoint\n", outfilename);
+    return false;
+  }
+  return true;
+}
+
+bool checkpoint_identify(struct checkpoint *c, FILE *in,
+                         struct sector_store *store) {
+#if defined(WIN32) || defined(WIN64)
+  struct _stat64 st;
+  if (_fstat64(_fileno(in), &st))
+    return false;
+#else
+  struct stat st;
+  if (fstat(fileno(in), &st))
+    return false;
+#endif
+  c->mtime = st.st_mtime;
+  c->inode = st.st_ino;
+  c->store[0] = 0;
+  c->storesize = 0;
+  if (store) {
+    snprintf(c->store, sizeof(c->store), "%s", store_name(store));
+    c->storesize = store_size(store);
+  }
+  return true;
+}
+
+bool checkpoint_matches(const struct checkpoint *c, FILE *in,
+                        struct sector_store *store) {
+  struct checkpoint now;
+  if (!checkpoint_identify(&now, in, store))
+    return false;
+  /* Others may have added to the store since, but nothing may be gone */
+  return (now.mtime == c->mtime) && (now.inode == c->inode) &&
+         !strcmp(now.store, c->store) && (now.storesize >= c->storesize);
+}
+
+void checkpoint_remove(const char *outfilename) {
+  char *name = checkpoint_name(outfilename, ".ckpt");
+  remove(name);
+  free(name);
+}
+
+bool file_sync(FILE *f) {
+  if (fflush(f))
+    return false;
+#if defined(WIN32) || defined(WIN64)
+  return !_commit(_fileno(f));
+#else
+  return !fsync(fileno(f));
+#endif
+}
+
+bool file_truncate(FILE *f, uint64_t size) {
+  fflush(f);
+#if defined(WIN32) || defined(WIN64)
+  return !_chsize_s(_fileno(f), size);
+#else
+  return !ftruncate(fileno(f), size);
+#endif
+}
@@ -20,14 +20,28 @@
 ** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 */
 
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include "unecm.h"
 
+#if defined(__linux__)
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 /* LUTs used for computing ECC/EDC */
 uint8_t ecc_f_lut[256];
 uint8_t ecc_b_lut[256];
 uint32_t edc_lut[256];
+uint32_t crc32_lut[256];
 
 /* Counters for analyze / encode / decode / total */
 unsigned mycounter_analyze;
@@ -45,6 +59,10 @@ void eccedc_init(void) {
     for (j = 0; j < 8; j++)
       edc = (edc >> 1) ^ (edc & 1 ? 0xD8018001 : 0);
     edc_lut[i] = edc;
+    edc = i;
+    for (j = 0; j < 8; j++)
+      edc = (edc >> 1) ^ (edc & 1 ? 0xEDB88320 : 0);
+    crc32_lut[i] = edc;
   }
 }
 
@@ -56,6 +74,14 @@ uint32_t edc_partial_computeblock(uint32_t edc, const uint8_t *src,
   return edc;
 }
 
+/* Compute CRC-32 (as used by zip) for a block */
+uint32_t crc32_computeblock(uint32_t crc, const uint8_t *src, size_t size) {
+  crc = ~crc;
+  while (size--)
+    crc = (crc >> 8) ^ crc32_lut[(crc ^ (*src++)) & 0xFF];
+  return ~crc;
+}
+
 /* Compute ECC for a block (can do either P or Q) */
 bool ecc_computeblock_encode(uint8_t *src, uint32_t major_count,
                              uint32_t minor_count, uint32_t major_mult,
@@ -158,6 +184,84 @@ void ecc_generate_decode(uint8_t *sector, bool zeroaddress) {
       sector[12 + i] = address[i];
 }
 
+static void edc_computeblock(const uint8_t *src, uint16_t size, uint8_t *dest) {
+  uint32_t edc = edc_partial_computeblock(0, src, size);
+  dest[0] = (edc >> 0) & 0xFF;
+  dest[1] = (edc >> 8) & 0xFF;
+  dest[2] = (edc >> 16) & 0xFF;
+  dest[3] = (edc >> 24) & 0xFF;
+}
+
+/***************************************************************************/
+/*
+** Generate ECC/EDC information for a sector (must be 2352 = 0x930 bytes)
+** Returns 0 on success
+*/
+void eccedc_generate(uint8_t *sector, int type) {
+  uint32_t i;
+  switch (type) {
+  case 1: /* Mode 1 */
+    /* Compute EDC */
+    edc_computeblock(sector + 0x00, 0x810, sector + 0x810);
+    /* Write out zero bytes */
+    for (i = 0; i < 8; i++)
+      sector[0x814 + i] = 0;
+    /* Generate ECC P/Q codes */
+    ecc_generate_decode(sector, false);
+    break;
+  case 2: /* Mode 2 form 1 */
+    /* Compute EDC */
+    edc_computeblock(sector + 0x10, 0x808, sector + 0x818);
+    /* Generate ECC P/Q codes */
+    ecc_generate_decode(sector, true);
+    break;
+  case 3: /* Mode 2 form 2 */
+    /* Compute EDC */
+    edc_computeblock(sector + 0x10, 0x91C, sector + 0x92C);
+    break;
+  }
+}
+
+/*
+** Rebuild a whole sector (2352 bytes) of a type from its plain ECM payload.
+** Type 2 and 3 sectors only have their last 2336 bytes filled in.
+*/
+void sector_rebuild(uint8_t *sector, unsigned type, const uint8_t *payload) {
+  if (type == 1) {
+    sector[0x00] = 0x00;
+    memset(sector + 0x01, 0xFF, 10);
+    sector[0x0B] = 0x00;
+    sector[0x0F] = 0x01;
+    memcpy(sector + 0x00C, payload, 0x003);
+    memcpy(sector + 0x010, payload + 0x003, 0x800);
+  } else {
+    memcpy(sector + 0x014, payload, record_payload_size(type));
+    memcpy(sector + 0x010, payload, 4);
+  }
+  eccedc_generate(sector, type);
+}
+
+/*
+** Read a type/count combo
+** Returns 0 on success, 1 on EOF
+*/
+int read_type_count(FILE *in, unsigned *type, unsigned *num) {
+  int c = fgetc(in);
+  int bits = 5;
+  if (c == EOF)
+    return 1;
+  *type = c & 3;
+  *num = (c >> 2) & 0x1F;
+  while (c & 0x80) {
+    c = fgetc(in);
+    if (c == EOF)
+      return 1;
+    *num |= ((unsigned)(c & 0x7F)) << bits;
+    bits += 7;
+  }
+  return 0;
+}
+
 /* Reset all counters */
 void resetcounter(unsigned total) {
   mycounter_analyze = 0;
@@ -204,3 +308,173 @@ void setcounter_decode(unsigned n) {
   }
   mycounter_analyze = n;
 }
+
+/* Bytes stored in the ECM file per sector (or literal byte) of a type */
+unsigned record_payload_size(unsigned type) {
+  switch (type) {
+  case 1:
+    return 0x803;
+  case 2:
+    return 0x804;
+  case 3:
+    return 0x918;
+  }
+  return 1;
+}
+
+/* Bytes of the original file per sector (or literal byte) of a type */
+unsigned record_output_size(unsigned type) {
+  switch (type) {
+  case 1:
+    return SECTOR_1_SIZE;
+  case 2:
+  case 3:
+    return SECTOR_2_SIZE;
+  }
+  return 1;
+}
+
+/* Build a frame header */
+void frame_header_pack(uint8_t *header, const struct ecm_frame *frame) {
+  header[0] = 'F';
+  header[1] = 'R';
+  header[2] = 'M';
+  header[3] = 0x00;
+  put_le32(header + 4, (uint32_t)frame->outoffset);
+  put_le32(header + 8, (uint32_t)(frame->outoffset >> 32));
+  put_le32(header + 12, frame->outbytes);
+  put_le32(header + 16, frame->encbytes);
+  put_le32(header + 20, frame->crc);
+  put_le32(header + 24, edc_partial_computeblock(0, header, 24));
+}
+
+/* Parse a frame header, returns false if it is not a valid one */
+bool frame_header_unpack(const uint8_t *header, struct ecm_frame *frame) {
+  if ((header[0] != 'F') || (header[1] != 'R') || (header[2] != 'M') ||
+      (header[3] != 0x00) ||
+      (get_le32(header + 24) != edc_partial_computeblock(0, header, 24)))
+    return false;
+  frame->outoffset =
+      get_le32(header + 4) | ((uint64_t)get_le32(header + 8) << 32);
+  frame->outbytes = get_le32(header + 12);
+  frame->encbytes = get_le32(header + 16);
+  frame->crc = get_le32(header + 20);
+  return true;
+}
+
+#if defined(__linux__)
+
+/* EDC job for literal passthrough, runs over a read-only map of the input */
+struct passthrough_edc {
+  const uint8_t *data;
+  size_t size;
+  unsigned edc;
+  uint32_t *crc;
+};
+
+static void *passthrough_edc_thread(void *arg) {
+  struct passthrough_edc *job = arg;
+  size_t done = 0;
+  while (done < job->size) {
+    size_t b = job->size - done;
+    if (b > 0x8000)
+      b = 0x8000;
+    job->edc = edc_partial_computeblock(job->edc, job->data + done, b);
+    if (job->crc)
+      *job->crc = crc32_computeblock(*job->crc, job->data + done, b);
+    done += b;
+  }
+  return NULL;
+}
+
+/* Copy a literal run between regular files without going through userspace */
+bool literal_passthrough(FILE *in, FILE *out, unsigned count, unsigned *edc,
+                         uint32_t *crc) {
+  struct passthrough_edc job;
+  struct stat st_in, st_out;
+  uint32_t crcval;
+  pthread_t thread;
+  uint8_t *map;
+  size_t maplen;
+  off_t inpos, outpos, mapstart, off_in, off_out;
+  size_t copied = 0;
+  int infd, outfd;
+
+  if (!out || (count < LITERAL_PASSTHROUGH_MIN))
+    return false;
+  infd = fileno(in);
+  outfd = fileno(out);
+  if (fstat(infd, &st_in) || fstat(outfd, &st_out) ||
+      !S_ISREG(st_in.st_mode) || !S_ISREG(st_out.st_mode))
+    return false;
+  inpos = ftello(in);
+  if (inpos < 0 || inpos + (off_t)count > st_in.st_size)
+    return false;
+  if (fflush(out))
+    return false;
+  outpos = ftello(out);
+  if (outpos < 0)
+    return false;
+  /* The EDC is taken from a map of the input while the kernel does the copy */
+  mapstart = inpos - inpos % sysconf(_SC_PAGESIZE);
+  maplen = (size_t)(inpos - mapstart) + count;
+  map = mmap(NULL, maplen, PROT_READ, MAP_SHARED, infd, mapstart);
+  if (map == MAP_FAILED)
+    return false;
+  madvise(map, maplen, MADV_SEQUENTIAL);
+  job.data = map + (inpos - mapstart);
+  job.size = count;
+  job.edc = *edc;
+  job.crc = crc ? &crcval : NULL;
+  crcval = crc ? *crc : 0;
+  if (pthread_create(&thread, NULL, passthrough_edc_thread, &job)) {
+    munmap(map, maplen);
+    return false;
+  }
+  off_in = inpos;
+  off_out = outpos;
+  while (copied < count) {
+    ssize_t r = copy_file_range(infd, &off_in, outfd, &off_out, count - copied,
+                                0);
+    if (r <= 0) {
+      /* No kernel copy between these files (e.g. EXDEV), write from the map */
+      r = pwrite(outfd, job.data + copied, count - copied, off_out);
+      if (r <= 0)
+        break;
+      off_in += r;
+      off_out += r;
+    }
+    copied += r;
+  }
+  pthread_join(thread, NULL);
+  /*
+  ** On failure the stdio positions are untouched, so the caller can redo the
+  ** run through the regular path
+  */
+  if ((copied != count) || fseeko(in, inpos + count, SEEK_SET) ||
+      fseeko(out, outpos + count, SEEK_SET)) {
+    munmap(map, maplen);
+    return false;
+  }
+  /* Hashed only now, a run that is redone must not be hashed twice */
+  image_hash(job.data, count);
+  munmap(map, maplen);
+  *edc = job.edc;
+  if (crc)
+    *crc = crcval;
+  return true;
+}
+
+#else
+
+bool literal_passthrough(FILE *in, FILE *out, unsigned count, unsigned *edc,
+                         uint32_t *crc) {
+  (void)in;
+  (void)out;
+  (void)count;
+  (void)edc;
+  (void)crc;
+  return false;
+}
+
+#endif
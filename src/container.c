@@ -0,0 +1,492 @@
+/***************************************************************************/
+/*
+** ECM - Encoder for ECM (Error Code Modeler) format.
+** Version 1.0
+** Copyright (C) 2002 Neill Corlett
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+/*
+** Track tables of CD image containers (Nero NRG, DiscJuggler CDI, CloneCD
+** CCD/IMG, Alcohol MDS/MDF).
+**
+** The tables only tell the encoder where sectors start and how big they
+** are, so that it can check each sector once instead of scanning byte by
+** byte. Every sector is still verified by check_type() and anything that
+** does not check out is stored as literal bytes, so a wrong or damaged
+** table costs compression, never correctness.
+*/
+/***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unecm.h"
+
+/* Chunks of a track table larger than this are assumed to be garbage */
+#define CONTAINER_CHUNK_MAX 0x1000000
+
+static uint32_t get_be16(const uint8_t *p) {
+  return ((uint32_t)p[0] << 8) | p[1];
+}
+
+static uint32_t get_be32(const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t get_be64(const uint8_t *p) {
+  return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+/*
+** Add a track. stride is the size of a sector in the image (including any
+** subchannel data), datasize is SECTOR_1_SIZE for raw sectors,
+** SECTOR_2_SIZE for mode 2 sectors without sync and header, or 0 if there
+** is nothing to gain (audio, 2048-byte user data only).
+*/
+static bool track_add(struct track_map *map, uint64_t start, uint64_t end,
+                      unsigned stride, unsigned datasize) {
+  struct track_region *region;
+  if ((end <= start) || (stride < datasize) || !stride)
+    return true;
+  region = realloc(map->region, (map->n + 1) * sizeof(*region));
+  if (!region)
+    return false;
+  map->region = region;
+  region += map->n++;
+  region->start = start;
+  region->end = end;
+  region->stride = stride;
+  region->datasize = datasize;
+  return true;
+}
+
+static int track_compare(const void *a, const void *b) {
+  const struct track_region *ra = a;
+  const struct track_region *rb = b;
+  return (ra->start > rb->start) - (ra->start < rb->start);
+}
+
+/* Sort the tracks and clip them to the image and to each other */
+static void track_finish(struct track_map *map, uint64_t size) {
+  size_t i, n = 0;
+  qsort(map->region, map->n, sizeof(*map->region), track_compare);
+  for (i = 0; i < map->n; i++) {
+    struct track_region region = map->region[i];
+    if ((i + 1 < map->n) && (region.end > map->region[i + 1].start))
+      region.end = map->region[i + 1].start;
+    if (region.end > size)
+      region.end = size;
+    if (region.end > region.start)
+      map->region[n++] = region;
+  }
+  map->n = n;
+}
+
+/* Open filename with its extension replaced by ext (either case) */
+static FILE *open_sidecar(const char *filename, const char *ext,
+                          const char *mode) {
+  size_t len = strlen(filename);
+  char *name;
+  FILE *f;
+  size_t i;
+  if ((len < 4) || (filename[len - 4] != '.'))
+    return NULL;
+  name = malloc(len + 1);
+  if (!name)
+    abort();
+  memcpy(name, filename, len - 3);
+  strcpy(name + len - 3, ext);
+  f = fopen(name, mode);
+  if (!f) {
+    for (i = len - 3; i < len; i++)
+      name[i] = name[i] - 'a' + 'A';
+    f = fopen(name, mode);
+  }
+  free(name);
+  return f;
+}
+
+static bool has_extension(const char *filename, const char *ext) {
+  size_t len = strlen(filename);
+  return (len > 4) && !strcasecmp(filename + len - 4, ext);
+}
+
+/***************************************************************************/
+/*
+** Nero: chunk list pointed to by a footer, with DAO and TAO track tables
+*/
+static bool nrg_parse(FILE *in, uint64_t size, struct track_map *map) {
+  uint8_t buf[12];
+  uint8_t *chunk = NULL;
+  uint64_t pos;
+  bool found = false;
+  if ((size < 12) || fseek(in, size - 12, SEEK_SET) ||
+      (fread(buf, 1, 12, in) != 12))
+    return false;
+  if (!memcmp(buf, "NER5", 4))
+    pos = get_be64(buf + 4);
+  else if (!memcmp(buf + 4, "NERO", 4))
+    pos = get_be32(buf + 8);
+  else
+    return false;
+  while (pos + 8 <= size) {
+    uint32_t len;
+    size_t i, n;
+    if (fseek(in, pos, SEEK_SET) || (fread(buf, 1, 8, in) != 8))
+      break;
+    len = get_be32(buf + 4);
+    if (!memcmp(buf, "END!", 4) || (len > CONTAINER_CHUNK_MAX))
+      break;
+    pos += 8 + len;
+    if (memcmp(buf, "DAOX", 4) && memcmp(buf, "DAOI", 4) &&
+        memcmp(buf, "ETN2", 4) && memcmp(buf, "ETNF", 4))
+      continue;
+    free(chunk);
+    chunk = malloc(len ? len : 1);
+    if (!chunk)
+      abort();
+    if (fread(chunk, 1, len, in) != len)
+      break;
+    if (!memcmp(buf, "DAO", 3)) {
+      /* 22-byte header, then 42 (DAOX) or 30 (DAOI) bytes per track */
+      bool x = buf[3] == 'X';
+      unsigned bsize = x ? 42 : 30;
+      n = len >= 22 ? (len - 22) / bsize : 0;
+      for (i = 0; i < n; i++) {
+        const uint8_t *t = chunk + 22 + i * bsize;
+        unsigned stride = get_be16(t + 12);
+        unsigned mode = t[14];
+        uint64_t start = x ? get_be64(t + 18) : get_be32(t + 18);
+        uint64_t end = x ? get_be64(t + 34) : get_be32(t + 26);
+        unsigned datasize = 0;
+        if ((mode != 0x07) && (mode != 0x10)) {
+          if (stride >= SECTOR_1_SIZE)
+            datasize = SECTOR_1_SIZE;
+          else if (stride == SECTOR_2_SIZE)
+            datasize = SECTOR_2_SIZE;
+        }
+        if (!track_add(map, start, end, stride, datasize))
+          goto fail;
+        found = true;
+      }
+    } else {
+      /* 28 (ETN2) or 20 (ETNF) bytes per track */
+      bool x = buf[3] == '2';
+      unsigned bsize = x ? 28 : 20;
+      n = len / bsize;
+      for (i = 0; i < n; i++) {
+        const uint8_t *t = chunk + i * bsize;
+        uint64_t start = x ? get_be64(t) : get_be32(t);
+        uint64_t end = start + (x ? get_be64(t + 8) : get_be32(t + 4));
+        unsigned stride = SECTOR_1_SIZE, datasize = 0;
+        switch (get_be32(t + (x ? 16 : 8))) {
+        case 0:
+          stride = 2048;
+          break;
+        case 3:
+          stride = SECTOR_2_SIZE;
+          datasize = SECTOR_2_SIZE;
+          break;
+        case 6:
+          datasize = SECTOR_1_SIZE;
+          break;
+        case 7:
+          break;
+        default:
+          continue;
+        }
+        if (!track_add(map, start, end, stride, datasize))
+          goto fail;
+        found = true;
+      }
+    }
+  }
+  free(chunk);
+  return found;
+fail:
+  free(chunk);
+  return false;
+}
+
+/* Sectors of a CDI image checked before trusting its layout */
+#define CDI_SAMPLES 16
+
+static const uint8_t cdi_sync[12] = {0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+                                     0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00};
+
+/*
+** Check that the 2352 bytes at pos are a raw sector: either they start
+** with a sync pattern, or (audio, or a track with only user data) a scan
+** would not find a sector starting anywhere in them either
+*/
+static bool cdi_sector_ok(FILE *in, uint64_t pos, uint64_t end) {
+  uint8_t buf[2 * SECTOR_1_SIZE];
+  uint8_t sector[4 + SECTOR_1_SIZE];
+  size_t have;
+  unsigned i;
+  if (fseek(in, (long)pos, SEEK_SET))
+    return false;
+  have = fread(buf, 1, end - pos < sizeof(buf) ? end - pos : sizeof(buf), in);
+  if (have < sizeof(cdi_sync))
+    return false;
+  if (!memcmp(buf, cdi_sync, sizeof(cdi_sync)))
+    return true;
+  for (i = 0; (i < SECTOR_1_SIZE) && (i + SECTOR_2_SIZE <= have); i++) {
+    const uint8_t *p = buf + i;
+    bool canbetype1 = (i + SECTOR_1_SIZE <= have) &&
+                      !memcmp(p, cdi_sync, sizeof(cdi_sync));
+    /* Silence passes for mode 2 sectors too, it does not count */
+    if (!canbetype1 && ((p[0] != p[4]) || (p[1] != p[5]) || (p[2] != p[6]) ||
+                        (p[3] != p[7]) || !(p[0] | p[1] | p[2] | p[3])))
+      continue;
+    /* check_type() scribbles (and restores) around the sector, so copy it */
+    memset(sector, 0, 4);
+    memcpy(sector + 4, p, canbetype1 ? SECTOR_1_SIZE : SECTOR_2_SIZE);
+    if (check_type(sector + 4, canbetype1))
+      return false;
+  }
+  return true;
+}
+
+/*
+** DiscJuggler: the footer gives the offset of the track descriptors, which
+** follow the track data. Only the extent of the data is taken from it; the
+** descriptors themselves vary too much between versions to be worth it.
+** The data is usually raw sectors, but tracks can also be stored as 2336
+** or 2048-byte sectors, so sectors spread over the extent are checked
+** before the raw layout is used.
+*/
+static bool cdi_parse(FILE *in, uint64_t size, struct track_map *map) {
+  uint8_t buf[8];
+  uint64_t end, sectors;
+  uint32_t version;
+  unsigned i;
+  if ((size < 8) || fseek(in, size - 8, SEEK_SET) ||
+      (fread(buf, 1, 8, in) != 8))
+    return false;
+  version = get_le32(buf);
+  if ((version == 0x80000004) || (version == 0x80000005))
+    end = get_le32(buf + 4);
+  else if (version == 0x80000006)
+    end = size - get_le32(buf + 4);
+  else
+    return false;
+  if ((end > size) || (end % SECTOR_1_SIZE))
+    return false;
+  sectors = end / SECTOR_1_SIZE;
+  for (i = 0; i < CDI_SAMPLES; i++)
+    if (!cdi_sector_ok(in, sectors * i / CDI_SAMPLES * SECTOR_1_SIZE, end))
+      return false;
+  return track_add(map, 0, end, SECTOR_1_SIZE, SECTOR_1_SIZE) && map->n;
+}
+
+/*
+** CloneCD: the image is raw sectors; the .ccd sidecar tells audio tracks
+** from data tracks
+*/
+static bool ccd_parse(const char *filename, uint64_t size,
+                      struct track_map *map) {
+  char line[256];
+  uint64_t start[100];
+  int mode[100];
+  int track = -1;
+  int i, last = -1;
+  FILE *f = open_sidecar(filename, "ccd", "r");
+  if (!f)
+    return false;
+  for (i = 0; i < 100; i++) {
+    start[i] = UINT64_MAX;
+    mode[i] = -1;
+  }
+  while (fgets(line, sizeof(line), f)) {
+    unsigned long v;
+    if (sscanf(line, "[TRACK %lu]", &v) == 1) {
+      track = v < 100 ? (int)v : -1;
+    } else if (track < 0) {
+      continue;
+    } else if (sscanf(line, "MODE=%lu", &v) == 1) {
+      mode[track] = v;
+    } else if ((sscanf(line, "INDEX 0=%lu", &v) == 1) ||
+               (sscanf(line, "INDEX 1=%lu", &v) == 1)) {
+      if ((uint64_t)v * SECTOR_1_SIZE < start[track])
+        start[track] = (uint64_t)v * SECTOR_1_SIZE;
+    }
+  }
+  fclose(f);
+  for (i = 99; i >= 0; i--) {
+    if ((start[i] == UINT64_MAX) || (mode[i] < 0))
+      continue;
+    if (!track_add(map, start[i], last < 0 ? size : start[last],
+                   SECTOR_1_SIZE, mode[i] ? SECTOR_1_SIZE : 0))
+      return false;
+    last = i;
+  }
+  /* No usable table; the image is still raw sectors */
+  if (!map->n)
+    return track_add(map, 0, size, SECTOR_1_SIZE, SECTOR_1_SIZE);
+  return true;
+}
+
+/*
+** Alcohol 120%: the .mds sidecar has session blocks pointing to 80-byte
+** track blocks with the sector size and the track's offset in the .mdf
+*/
+static bool mds_parse(const char *filename, uint64_t size,
+                      struct track_map *map) {
+  uint8_t header[88];
+  uint8_t session[24];
+  uint8_t block[80];
+  unsigned sessions, s, b;
+  bool found = false;
+  FILE *f = open_sidecar(filename, "mds", "rb");
+  if (!f)
+    return false;
+  if ((fread(header, 1, sizeof(header), f) != sizeof(header)) ||
+      memcmp(header, "MEDIA DESCRIPTOR", 16))
+    goto done;
+  sessions = get_le16(header + 0x14);
+  for (s = 0; s < sessions; s++) {
+    uint32_t blocks;
+    if (fseek(f, get_le32(header + 0x50) + s * sizeof(session), SEEK_SET) ||
+        (fread(session, 1, sizeof(session), f) != sizeof(session)))
+      goto done;
+    blocks = get_le32(session + 20);
+    for (b = 0; b < session[10]; b++) {
+      unsigned stride, datasize = 0;
+      if (fseek(f, blocks + b * sizeof(block), SEEK_SET) ||
+          (fread(block, 1, sizeof(block), f) != sizeof(block)))
+        goto done;
+      /* Points 1-99 are tracks, the rest are lead-in entries */
+      if ((block[4] < 1) || (block[4] > 99))
+        continue;
+      stride = get_le16(block + 16);
+      if ((block[0] & 0x0F) != 0x09) {
+        unsigned sector = stride - (block[1] ? 96 : 0);
+        if ((sector == SECTOR_1_SIZE) || (sector == SECTOR_2_SIZE))
+          datasize = sector;
+      }
+      /* Tracks run up to the next one; track_finish() clips them */
+      if (!track_add(map, get_le64(block + 40), size, stride, datasize))
+        goto done;
+      found = true;
+    }
+  }
+done:
+  fclose(f);
+  return found;
+}
+
+/***************************************************************************/
+
+const char *container_tracks(const char *filename, struct track_map *map) {
+  const char *name = NULL;
+  uint64_t size;
+  FILE *in;
+  map->region = NULL;
+  map->n = 0;
+  in = fopen(filename, "rb");
+  if (!in)
+    return NULL;
+  fseek(in, 0, SEEK_END);
+  size = ftell(in);
+  if (nrg_parse(in, size, map))
+    name = "NRG";
+  else if (!map->n && cdi_parse(in, size, map))
+    name = "CDI";
+  else if (!map->n && has_extension(filename, ".mdf") &&
+           mds_parse(filename, size, map))
+    name = "MDS";
+  else if (!map->n && has_extension(filename, ".img") &&
+           ccd_parse(filename, size, map))
+    name = "CCD";
+  fclose(in);
+  if (!name) {
+    container_free(map);
+    return NULL;
+  }
+  track_finish(map, size);
+  return name;
+}
+
+void container_free(struct track_map *map) {
+  free(map->region);
+  map->region = NULL;
+  map->n = 0;
+}
+
+/***************************************************************************/
+
+int track_hint(const struct track_map *map, uint64_t pos, const uint8_t *data,
+               uint64_t avail, uint64_t *count, bool *canbetype1) {
+  const struct track_region *region;
+  size_t lo = 0, hi = map ? map->n : 0;
+  uint64_t rel, next;
+  int hint = TRACK_LITERAL;
+  if (!hi)
+    return TRACK_SCAN;
+  while (hi - lo > 1) {
+    size_t mid = (lo + hi) / 2;
+    if (map->region[mid].start <= pos)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  region = &map->region[lo];
+  if ((pos < region->start) || (pos >= region->end))
+    return TRACK_SCAN;
+  rel = (pos - region->start) % region->stride;
+  next = pos - rel + region->stride;
+  if (next > region->end)
+    next = region->end;
+  *canbetype1 = false;
+  switch (region->datasize) {
+  case SECTOR_1_SIZE:
+    /*
+    ** Raw sectors: mode 1 is checked from the sync, mode 2 from the
+    ** subheader with the 16 bytes in front of it going out as literals
+    */
+    if (rel == 0) {
+      if ((avail >= SECTOR_1_SIZE) && (pos + SECTOR_1_SIZE <= region->end) &&
+          (data[0x0F] == 0x01)) {
+        hint = TRACK_CHECK;
+        *canbetype1 = true;
+      } else if ((avail >= 0x10) && (data[0x0F] == 0x02)) {
+        next = pos + 0x10;
+      }
+    } else if (rel == 0x10) {
+      if ((avail >= SECTOR_2_SIZE) && (pos + SECTOR_2_SIZE <= region->end))
+        hint = TRACK_CHECK;
+    } else if (rel < 0x10) {
+      next = pos - rel + 0x10;
+    }
+    break;
+  case SECTOR_2_SIZE:
+    if ((rel == 0) && (avail >= SECTOR_2_SIZE) &&
+        (pos + SECTOR_2_SIZE <= region->end))
+      hint = TRACK_CHECK;
+    break;
+  default:
+    /* Nothing to model, the whole track is literal */
+    next = region->end;
+    break;
+  }
+  *count = next - pos;
+  if (*count > avail)
+    *count = avail;
+  return hint;
+}
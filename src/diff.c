@@ -0,0 +1,294 @@
+/***************************************************************************/
+/*
+** ECM - Encoder for ECM (Error Code Modeler) format.
+** Version 1.0
+** Copyright (C) 2002 Neill Corlett
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+/*
+** Compare the original files of two ECM files without decoding them.
+**
+** The record maps of both files are walked side by side in terms of the
+** original file. Where both have sectors of the same type starting at the
+** same offset, equal payloads mean equal sectors, so the payloads are
+** compared as they are (for files with a sector store, just the header and
+** the SHA-1 of each sector). Only where the records do not line up are the
+** original bytes rebuilt on both sides and compared.
+*/
+/***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unecm.h"
+
+/* Bytes read from each file at a time */
+#define DIFF_CHUNK 0x100000
+
+struct diff_file {
+  const char *name;
+  FILE *f;
+  struct ecm_index index;
+  struct ecm_source source;
+  size_t r; /* Record at the current offset */
+  uint8_t *buf;
+};
+
+/*
+** Differing bytes found so far; ranges that are in the same or adjacent
+** sectors are merged into one before it is printed
+*/
+struct diff_report {
+  uint64_t start;
+  uint64_t end;
+  unsigned ranges;
+  uint64_t sectors;
+};
+
+static bool diff_pread(void *ctx, uint64_t offset, uint8_t *buf,
+                       size_t size) {
+  FILE *f = ctx;
+  return !fseek(f, (long)offset, SEEK_SET) && (fread(buf, 1, size, f) == size);
+}
+
+static void diff_flush(struct diff_report *d) {
+  if (d->start == d->end)
+    return;
+  printf("Differ: LBA %llu-%llu (bytes %llu-%llu)\n",
+         (unsigned long long)(d->start / SECTOR_1_SIZE),
+         (unsigned long long)((d->end - 1) / SECTOR_1_SIZE),
+         (unsigned long long)d->start, (unsigned long long)d->end - 1);
+  d->ranges++;
+  d->sectors += (d->end - 1) / SECTOR_1_SIZE - d->start / SECTOR_1_SIZE + 1;
+  d->start = d->end;
+}
+
+static void diff_mark(struct diff_report *d, uint64_t start, uint64_t end) {
+  if ((d->start == d->end) ||
+      (start / SECTOR_1_SIZE > (d->end - 1) / SECTOR_1_SIZE + 1)) {
+    diff_flush(d);
+    d->start = start;
+  }
+  d->end = end;
+}
+
+static uint64_t record_end(const struct ecm_record *r) {
+  return r->outoffset + (uint64_t)r->count * record_output_size(r->type);
+}
+
+/* Report why a file could not be read */
+static bool diff_fail(const struct diff_file *file,
+                      const struct sector_store *store) {
+  if ((file->index.flags & ECM_FLAG_STORE) && !store)
+    fprintf(stderr, "%s needs its sector store (--store)\n", file->name);
+  else
+    fprintf(stderr, "%s is damaged\n", file->name);
+  return false;
+}
+
+/*
+** Compare size original bytes at offset by rebuilding them on both sides
+*/
+static bool diff_rebuild(struct diff_file *a, struct diff_file *b,
+                         struct sector_store *store, uint64_t offset,
+                         uint64_t size, struct diff_report *d) {
+  while (size) {
+    size_t n = size < DIFF_CHUNK ? size : DIFF_CHUNK;
+    size_t i = 0;
+    if (!ecm_index_read(&a->index, &a->source, store, offset, a->buf, n))
+      return diff_fail(a, store);
+    if (!ecm_index_read(&b->index, &b->source, store, offset, b->buf, n))
+      return diff_fail(b, store);
+    if (memcmp(a->buf, b->buf, n)) {
+      while (i < n) {
+        size_t j = i;
+        while ((j < n) && (a->buf[j] != b->buf[j]))
+          j++;
+        if (j > i)
+          diff_mark(d, offset + i, offset + j);
+        while ((j < n) && (a->buf[j] == b->buf[j]))
+          j++;
+        i = j;
+      }
+    }
+    offset += n;
+    size -= n;
+  }
+  return true;
+}
+
+/*
+** Compare count sectors (or literal bytes) of the same type, starting at
+** sector ka of record ra and sector kb of record rb, by their payloads
+*/
+static bool diff_payloads(struct diff_file *a, const struct ecm_record *ra,
+                          uint32_t ka, struct diff_file *b,
+                          const struct ecm_record *rb, uint32_t kb,
+                          uint32_t count, struct sector_store *store,
+                          struct diff_report *d) {
+  unsigned type = ra->type;
+  unsigned unit = record_output_size(type);
+  unsigned sa = ecm_index_payload_size(&a->index, type);
+  unsigned sb = ecm_index_payload_size(&b->index, type);
+  uint64_t offset = ra->outoffset + (uint64_t)ka * unit;
+  unsigned cmp;
+  uint32_t i;
+  if (sa != sb) {
+    /* One file has its sectors in a store, the other does not */
+    for (i = 0; i < count; i++, offset += unit) {
+      if (!ecm_index_payload(&a->index, &a->source, store, ra, ka + i,
+                             a->buf))
+        return diff_fail(a, store);
+      if (!ecm_index_payload(&b->index, &b->source, store, rb, kb + i,
+                             b->buf))
+        return diff_fail(b, store);
+      if (memcmp(a->buf, b->buf, record_payload_size(type)))
+        diff_mark(d, offset, offset + unit);
+    }
+    return true;
+  }
+  /* The store offset of a reference depends on the store, the key does not */
+  cmp = (type && (a->index.flags & ECM_FLAG_STORE)) ? sa - 8 : sa;
+  while (count) {
+    uint32_t n = count < DIFF_CHUNK / sa ? count : DIFF_CHUNK / sa;
+    if (!a->source.read(a->source.ctx, ra->inoffset + (uint64_t)ka * sa,
+                        a->buf, (size_t)n * sa))
+      return diff_fail(a, store);
+    if (!b->source.read(b->source.ctx, rb->inoffset + (uint64_t)kb * sb,
+                        b->buf, (size_t)n * sb))
+      return diff_fail(b, store);
+    if ((cmp != sa) || memcmp(a->buf, b->buf, (size_t)n * sa)) {
+      for (i = 0; i < n; i++)
+        if (memcmp(a->buf + (size_t)i * sa, b->buf + (size_t)i * sb, cmp))
+          diff_mark(d, offset + (uint64_t)i * unit,
+                    offset + (uint64_t)(i + 1) * unit);
+    }
+    ka += n;
+    kb += n;
+    offset += (uint64_t)n * unit;
+    count -= n;
+  }
+  return true;
+}
+
+static bool diff_open(struct diff_file *file, const char *name) {
+  file->name = name;
+  file->r = 0;
+  file->f = fopen(name, "rb");
+  if (!file->f) {
+    perror(name);
+    return false;
+  }
+  if (!ecm_index_build(file->f, &file->index)) {
+    fprintf(stderr, "%s is not a valid ECM file\n", name);
+    fclose(file->f);
+    return false;
+  }
+  file->source.read = diff_pread;
+  file->source.ctx = file->f;
+  file->buf = malloc(DIFF_CHUNK);
+  if (!file->buf) {
+    fprintf(stderr, "Out of memory\n");
+    ecm_index_free(&file->index);
+    fclose(file->f);
+    return false;
+  }
+  return true;
+}
+
+static void diff_close(struct diff_file *file) {
+  free(file->buf);
+  ecm_index_free(&file->index);
+  fclose(file->f);
+}
+
+/* Record of file at offset, which is not before the current one */
+static const struct ecm_record *diff_record(struct diff_file *file,
+                                            uint64_t offset) {
+  while (record_end(&file->index.record[file->r]) <= offset)
+    file->r++;
+  return &file->index.record[file->r];
+}
+
+int ecm_diff(const char *afilename, const char *bfilename,
+             const char *storefilename) {
+  struct diff_file a, b;
+  struct diff_file *longer;
+  struct sector_store *store = NULL;
+  struct diff_report d;
+  uint64_t offset = 0;
+  uint64_t end;
+  int r = 2;
+  if (!diff_open(&a, afilename))
+    return 2;
+  if (!diff_open(&b, bfilename)) {
+    diff_close(&a);
+    return 2;
+  }
+  if (storefilename) {
+    store = store_open_read(storefilename);
+    if (!store)
+      goto done;
+  }
+  memset(&d, 0, sizeof(d));
+  end = a.index.size < b.index.size ? a.index.size : b.index.size;
+  while (offset < end) {
+    const struct ecm_record *ra = diff_record(&a, offset);
+    const struct ecm_record *rb = diff_record(&b, offset);
+    unsigned unit = record_output_size(ra->type);
+    uint64_t stop = record_end(ra);
+    uint64_t count;
+    if (record_end(rb) < stop)
+      stop = record_end(rb);
+    if (end < stop)
+      stop = end;
+    if ((ra->type == rb->type) && !((offset - ra->outoffset) % unit) &&
+        !((offset - rb->outoffset) % unit)) {
+      count = (stop - offset) / unit;
+      if (count &&
+          !diff_payloads(&a, ra, (offset - ra->outoffset) / unit, &b, rb,
+                         (offset - rb->outoffset) / unit, count, store, &d))
+        goto done;
+      offset += count * unit;
+    }
+    /* Records that do not line up (or a partial sector at the end) */
+    if ((offset < stop) &&
+        !diff_rebuild(&a, &b, store, offset, stop - offset, &d))
+      goto done;
+    offset = stop;
+  }
+  diff_flush(&d);
+  r = d.ranges ? 1 : 0;
+  if (a.index.size != b.index.size) {
+    longer = a.index.size > b.index.size ? &a : &b;
+    printf("Only in %s: bytes %llu-%llu\n", longer->name,
+           (unsigned long long)end,
+           (unsigned long long)longer->index.size - 1);
+    r = 1;
+  }
+  if (d.ranges)
+    printf("%llu sectors differ in %u ranges\n",
+           (unsigned long long)d.sectors, d.ranges);
+  else if (!r)
+    printf("Images are identical (%llu bytes)\n", (unsigned long long)end);
+done:
+  if (store)
+    store_close(store);
+  diff_close(&a);
+  diff_close(&b);
+  return r;
+}
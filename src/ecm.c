@@ -133,21 +133,46 @@ void write_type_count(FILE *out, unsigned type, unsigned count) {
 }
 
 
+/***************************************************************************/
+/*
+** Write the data part of a sector, or a reference to it if there is a store
+*/
+void write_sector_data(struct sector_store *store, const uint8_t *data,
+                       unsigned size, FILE *out) {
+  uint8_t ref[STORE_REF_SIZE];
+  if (!store) {
+    fwrite(data, 1, size, out);
+    return;
+  }
+  /* On failure the store remembers it and store_close() reports it */
+  if (!store_put(store, data, size, ref))
+    memset(ref, 0, sizeof(ref));
+  fwrite(ref, 1, sizeof(ref), out);
+}
+
 /***************************************************************************/
 /*
 ** Encode a run of sectors/literals of the same type
+** The CRC of the input is kept in crc as well, if it is not NULL
 */
-unsigned in_flush(unsigned edc, unsigned type, unsigned count, FILE *in,
-                  FILE *out) {
+unsigned in_flush(unsigned edc, uint32_t *crc, unsigned type, unsigned count,
+                  FILE *in, FILE *out, struct sector_store *store) {
   unsigned char buf[SECTOR_1_SIZE];
   write_type_count(out, type, count);
   if (!type) {
+    if (literal_passthrough(in, out, count, &edc, crc)) {
+      setcounter_encode(ftell(in));
+      return edc;
+    }
     while (count) {
       unsigned b = count;
       if (b > SECTOR_1_SIZE)
         b = SECTOR_1_SIZE;
       fread(buf, 1, b, in);
       edc = edc_partial_computeblock(edc, buf, b);
+      image_hash(buf, b);
+      if (crc)
+        *crc = crc32_computeblock(*crc, buf, b);
       fwrite(buf, 1, b, out);
       count -= b;
       setcounter_encode(ftell(in));
@@ -159,20 +184,31 @@ unsigned in_flush(unsigned edc, unsigned type, unsigned count, FILE *in,
     case 1:
       fread(buf, 1, SECTOR_1_SIZE, in);
       edc = edc_partial_computeblock(edc, buf, SECTOR_1_SIZE);
+      image_hash(buf, SECTOR_1_SIZE);
+      if (crc)
+        *crc = crc32_computeblock(*crc, buf, SECTOR_1_SIZE);
       fwrite(buf + 0x00C, 1, 0x003, out);
-      fwrite(buf + 0x010, 1, 0x800, out);
+      write_sector_data(store, buf + 0x010, 0x800, out);
       setcounter_encode(ftell(in));
       break;
     case 2:
       fread(buf, 1, SECTOR_2_SIZE, in);
       edc = edc_partial_computeblock(edc, buf, SECTOR_2_SIZE);
-      fwrite(buf + 0x004, 1, 0x804, out);
+      image_hash(buf, SECTOR_2_SIZE);
+      if (crc)
+        *crc = crc32_computeblock(*crc, buf, SECTOR_2_SIZE);
+      fwrite(buf + 0x004, 1, 0x004, out);
+      write_sector_data(store, buf + 0x008, 0x800, out);
       setcounter_encode(ftell(in));
       break;
     case 3:
       fread(buf, 1, SECTOR_2_SIZE, in);
       edc = edc_partial_computeblock(edc, buf, SECTOR_2_SIZE);
-      fwrite(buf + 0x004, 1, 0x918, out);
+      image_hash(buf, SECTOR_2_SIZE);
+      if (crc)
+        *crc = crc32_computeblock(*crc, buf, SECTOR_2_SIZE);
+      fwrite(buf + 0x004, 1, 0x004, out);
+      write_sector_data(store, buf + 0x008, 0x914, out);
       setcounter_encode(ftell(in));
       break;
     }
@@ -180,21 +216,98 @@ unsigned in_flush(unsigned edc, unsigned type, unsigned count, FILE *in,
   return edc;
 }
 
+/***************************************************************************/
+/*
+** Frame writer for framed ECM files
+*/
+struct frame_writer {
+  uint32_t size;        /* Output bytes per frame, 0 if not framed */
+  long header;          /* Position of the open frame's header, -1 if none */
+  struct ecm_frame frame;
+};
+
+void frame_close(struct frame_writer *fw, FILE *out) {
+  unsigned char header[ECM_FRAME_HEADER_SIZE];
+  long end = ftell(out);
+  if (fw->header < 0)
+    return;
+  fw->frame.encbytes = end - fw->header - ECM_FRAME_HEADER_SIZE;
+  frame_header_pack(header, &fw->frame);
+  fseek(out, fw->header, SEEK_SET);
+  fwrite(header, 1, sizeof(header), out);
+  fseek(out, end, SEEK_SET);
+  fw->frame.outoffset += fw->frame.outbytes;
+  fw->header = -1;
+}
+
+void frame_open(struct frame_writer *fw, FILE *out) {
+  unsigned char header[ECM_FRAME_HEADER_SIZE];
+  /* Placeholder, filled in by frame_close() */
+  memset(header, 0, sizeof(header));
+  fw->header = ftell(out);
+  fw->frame.outbytes = 0;
+  fw->frame.encbytes = 0;
+  fw->frame.crc = 0;
+  fwrite(header, 1, sizeof(header), out);
+}
+
+/*
+** Encode a run, splitting it across frames if the file is framed
+*/
+unsigned write_run(struct frame_writer *fw, unsigned edc, unsigned type,
+                   unsigned count, FILE *in, FILE *out,
+                   struct sector_store *store) {
+  unsigned unit = record_output_size(type);
+  if (!fw->size)
+    return in_flush(edc, NULL, type, count, in, out, store);
+  while (count) {
+    unsigned n;
+    if ((fw->header >= 0) && (fw->size - fw->frame.outbytes < unit))
+      frame_close(fw, out);
+    if (fw->header < 0)
+      frame_open(fw, out);
+    n = (fw->size - fw->frame.outbytes) / unit;
+    if (n > count)
+      n = count;
+    edc = in_flush(edc, &fw->frame.crc, type, n, in, out, store);
+    fw->frame.outbytes += n * unit;
+    count -= n;
+  }
+  return edc;
+}
+
 /***************************************************************************/
 
-int ecmify(FILE *in, FILE *out) {
+/*
+** Encode in to out. If outfilename is not NULL, a checkpoint is saved for
+** it every CHECKPOINT_INTERVAL input bytes; if resume is not NULL, the
+** encode goes on from there.
+*/
+int ecmify(FILE *in, FILE *out, uint32_t framesize,
+           const struct track_map *tracks, struct sector_store *store,
+           const char *outfilename, const struct checkpoint *resume) {
+  struct frame_writer fw;
+  struct checkpoint ckpt;
   unsigned char inputqueue[1048576 + 4];
   unsigned inedc = 0;
+  unsigned flags = (framesize ? ECM_FLAG_FRAMED : 0x00) |
+                   (store ? ECM_FLAG_STORE : 0x00);
   int curtype = -1;
-  int curtypecount = 0;
-  int curtype_in_start = 0;
+  long curtypecount = 0;
+  long curtype_in_start = 0;
   int detecttype;
-  int incheckpos = 0;
-  int inbufferpos = 0;
-  int intotallength;
+  int step;
+  long incheckpos = 0;
+  long inbufferpos = 0;
+  long intotallength;
+  long lastcheckpoint = 0;
   int inqueuestart = 0;
   int dataavail = 0;
-  int typetally[4];
+  long typetally[4];
+  uint64_t literal;
+  bool canbetype1;
+  int hint;
+  int i;
   fseek(in, 0, SEEK_END);
   intotallength = ftell(in);
   resetcounter(intotallength);
@@ -202,15 +315,42 @@ int ecmify(FILE *in, FILE *out) {
   typetally[1] = 0;
   typetally[2] = 0;
   typetally[3] = 0;
-  /* Magic identifier */
-  fputc('E', out);
-  fputc('C', out);
-  fputc('M', out);
-  fputc(0x00, out);
+  memset(&fw, 0, sizeof(fw));
+  fw.size = framesize;
+  fw.header = -1;
+  if (resume) {
+    if ((resume->insize != (uint64_t)intotallength) ||
+        (resume->flags != flags) || (resume->container != (tracks != NULL)) ||
+        !checkpoint_matches(resume, in, store)) {
+      fprintf(stderr, "Checkpoint does not match the input or options\n");
+      return 1;
+    }
+    fprintf(stderr, "Resuming at input byte %llu\n",
+            (unsigned long long)resume->in);
+    incheckpos = resume->in;
+    inbufferpos = resume->in;
+    lastcheckpoint = resume->in;
+    inedc = resume->edc;
+    fw.header = resume->frameheader;
+    fw.frame = resume->frame;
+    for (i = 0; i < 4; i++)
+      typetally[i] = resume->count[i];
+    if (resume->runtype >= 0) {
+      curtype = resume->runtype;
+      curtype_in_start = resume->runstart;
+      curtypecount = resume->runcount;
+    }
+  } else {
+    /* Magic identifier */
+    fputc('E', out);
+    fputc('C', out);
+    fputc('M', out);
+    fputc(flags, out);
+  }
   for (;;) {
     if ((dataavail < SECTOR_1_SIZE) && (dataavail < (intotallength - inbufferpos))) {
-      int willread = intotallength - inbufferpos;
-      if (willread > ((sizeof(inputqueue) - 4) - dataavail))
+      long willread = intotallength - inbufferpos;
+      if (willread > (long)((sizeof(inputqueue) - 4) - dataavail))
         willread = (sizeof(inputqueue) - 4) - dataavail;
       if (inqueuestart) {
         memmove(inputqueue + 4, inputqueue + 4 + inqueuestart, dataavail);
@@ -226,60 +366,109 @@ int ecmify(FILE *in, FILE *out) {
     }
     if (dataavail <= 0)
       break;
-    if (dataavail < SECTOR_2_SIZE) {
+    /* Inside a known track, only look where sectors start */
+    hint = track_hint(tracks, incheckpos, inputqueue + 4 + inqueuestart,
+                      dataavail, &literal, &canbetype1);
+    step = 1;
+    if (hint == TRACK_LITERAL) {
+      detecttype = 0;
+      step = literal;
+    } else if (dataavail < SECTOR_2_SIZE) {
       detecttype = 0;
     } else {
-      detecttype = check_type(inputqueue + 4 + inqueuestart, false);
+      detecttype = check_type(inputqueue + 4 + inqueuestart,
+                              (hint == TRACK_CHECK) && canbetype1);
+      if ((hint == TRACK_CHECK) && !detecttype)
+        step = literal;
     }
-    if (detecttype != curtype) {
+    if ((detecttype != curtype) || (curtypecount == ECM_RUN_MAX)) {
       if (curtypecount) {
         fseek(in, curtype_in_start, SEEK_SET);
         typetally[curtype] += curtypecount;
-        inedc = in_flush(inedc, curtype, curtypecount, in, out);
+        inedc = write_run(&fw, inedc, curtype, curtypecount, in, out,
+                          store);
       }
       curtype = detecttype;
       curtype_in_start = incheckpos;
-      curtypecount = 1;
-    } else {
-      curtypecount++;
+      curtypecount = 0;
     }
+    /* The rest of a long literal stretch goes in the next record */
+    if (!curtype && (step > ECM_RUN_MAX - curtypecount))
+      step = ECM_RUN_MAX - curtypecount;
     switch (curtype) {
     case 0:
-      incheckpos += 1;
-      inqueuestart += 1;
-      dataavail -= 1;
+      curtypecount += step;
+      incheckpos += step;
+      inqueuestart += step;
+      dataavail -= step;
       break;
     case 1:
+      curtypecount++;
       incheckpos += SECTOR_1_SIZE;
       inqueuestart += SECTOR_1_SIZE;
       dataavail -= SECTOR_1_SIZE;
       break;
     case 2:
     case 3:
+      curtypecount++;
       incheckpos += SECTOR_2_SIZE;
       inqueuestart += SECTOR_2_SIZE;
       dataavail -= SECTOR_2_SIZE;
       break;
     }
+    if (outfilename && (incheckpos - lastcheckpoint >= CHECKPOINT_INTERVAL)) {
+      memset(&ckpt, 0, sizeof(ckpt));
+      ckpt.insize = intotallength;
+      ckpt.in = incheckpos;
+      ckpt.out = ftell(out);
+      ckpt.edc = inedc;
+      ckpt.flags = flags;
+      ckpt.frameheader = fw.header;
+      ckpt.frame = fw.frame;
+      for (i = 0; i < 4; i++)
+        ckpt.count[i] = typetally[i];
+      /* The open run goes on after a resume, splitting it would cost bytes */
+      ckpt.runtype = curtypecount ? curtype : -1;
+      ckpt.runstart = curtype_in_start;
+      ckpt.runcount = curtypecount;
+      ckpt.container = tracks != NULL;
+      /* Everything the checkpoint covers must be on disk before it is */
+      if (checkpoint_identify(&ckpt, in, store) && file_sync(out) &&
+          (!store || store_sync(store)))
+        checkpoint_save(outfilename, &ckpt);
+      lastcheckpoint = incheckpos;
+    }
   }
   if (curtypecount) {
     fseek(in, curtype_in_start, SEEK_SET);
     typetally[curtype] += curtypecount;
-    inedc = in_flush(inedc, curtype, curtypecount, in, out);
+    inedc = write_run(&fw, inedc, curtype, curtypecount, in, out, store);
+  }
+  if (framesize) {
+    unsigned char header[ECM_FRAME_HEADER_SIZE];
+    /* Empty frame marks the end and holds the input file EDC */
+    frame_close(&fw, out);
+    fw.frame.outbytes = 0;
+    fw.frame.encbytes = 0;
+    fw.frame.crc = inedc;
+    frame_header_pack(header, &fw.frame);
+    fwrite(header, 1, sizeof(header), out);
+  } else {
+    /* End-of-records indicator */
+    write_type_count(out, 0, 0);
+    /* Input file EDC */
+    fputc((inedc >> 0) & 0xFF, out);
+    fputc((inedc >> 8) & 0xFF, out);
+    fputc((inedc >> 16) & 0xFF, out);
+    fputc((inedc >> 24) & 0xFF, out);
   }
-  /* End-of-records indicator */
-  write_type_count(out, 0, 0);
-  /* Input file EDC */
-  fputc((inedc >> 0) & 0xFF, out);
-  fputc((inedc >> 8) & 0xFF, out);
-  fputc((inedc >> 16) & 0xFF, out);
-  fputc((inedc >> 24) & 0xFF, out);
   /* Show report */
-  fprintf(stderr, "Literal bytes........... %10d\n", typetally[0]);
-  fprintf(stderr, "Mode 1 sectors.......... %10d\n", typetally[1]);
-  fprintf(stderr, "Mode 2 form 1 sectors... %10d\n", typetally[2]);
-  fprintf(stderr, "Mode 2 form 2 sectors... %10d\n", typetally[3]);
-  fprintf(stderr, "Encoded %d bytes -> %ld bytes\n", intotallength, ftell(out));
+  fprintf(stderr, "Literal bytes........... %10ld\n", typetally[0]);
+  fprintf(stderr, "Mode 1 sectors.......... %10ld\n", typetally[1]);
+  fprintf(stderr, "Mode 2 form 1 sectors... %10ld\n", typetally[2]);
+  fprintf(stderr, "Mode 2 form 2 sectors... %10ld\n", typetally[3]);
+  fprintf(stderr, "Encoded %ld bytes -> %ld bytes\n", intotallength,
+          ftell(out));
   fprintf(stderr, "Done.\n");
   return 0;
 }
@@ -290,6 +479,16 @@ int main(int argc, char **argv) {
   FILE *fin, *fout;
   char *infilename;
   char *outfilename;
+  uint32_t framesize = 0;
+  unsigned hashes = 0;
+  bool usetracks = true;
+  struct track_map tracks;
+  const char *container = NULL;
+  const char *storename = NULL;
+  struct sector_store *store = NULL;
+  struct checkpoint resume;
+  bool resuming = false;
+  int r = 0;
 
   fprintf(stderr, "ECM - Encoder for Error Code Modeler format v1.0\n"
                   "Copyright (C) 2002 Neill Corlett\n\n");
@@ -299,13 +498,91 @@ int main(int argc, char **argv) {
   */
   eccedc_init();
   /*
+  ** Analyze-only mode
+  */
+  if ((argc >= 2) && !strcasecmp(argv[1], "--analyze")) {
+    unsigned threads = 0;
+    bool json = false;
+    int i;
+    for (i = 2; i < argc - 1; i++) {
+      if (!strcasecmp(argv[i], "--json")) {
+        json = true;
+      } else if (!strcasecmp(argv[i], "--no-container")) {
+        usetracks = false;
+      } else if (!strcasecmp(argv[i], "--threads") && (i + 1 < argc - 1)) {
+        threads = strtoul(argv[++i], NULL, 10);
+      } else {
+        break;
+      }
+    }
+    if (i == argc - 1)
+      return analyze(argv[i], threads, json, usetracks);
+    argc = 0;
+  }
+  /*
+  ** Compare mode
+  */
+  if ((argc >= 2) && !strcasecmp(argv[1], "--diff")) {
+    if ((argc >= 4) && !strcasecmp(argv[2], "--store")) {
+      storename = argv[3];
+      argc -= 2;
+      argv += 2;
+    }
+    if (argc == 4)
+      return ecm_diff(argv[2], argv[3], storename);
+    argc = 0;
+  }
+  /*
   ** Check command line
   */
+  while (argc >= 2) {
+    if (!strcasecmp(argv[1], "--framed")) {
+      framesize = ECM_FRAME_SIZE;
+    } else if (!strcasecmp(argv[1], "--no-container")) {
+      usetracks = false;
+    } else if (!strcasecmp(argv[1], "--resume")) {
+      resuming = true;
+    } else if (!strcasecmp(argv[1], "--store") && (argc >= 3)) {
+      storename = argv[2];
+      argv[2] = argv[0];
+      argc--;
+      argv++;
+    } else if (!strcasecmp(argv[1], "--hash") && (argc >= 3)) {
+      hashes = hash_parse(argv[2]);
+      if (!hashes) {
+        fprintf(stderr, "unknown hash list '%s'\n", argv[2]);
+        return 1;
+      }
+      argv[2] = argv[0];
+      argc--;
+      argv++;
+    } else {
+      break;
+    }
+    argv[1] = argv[0];
+    argc--;
+    argv++;
+  }
   if ((argc != 2) && (argc != 3)) {
-    fprintf(stderr, "usage: %s cdimagefile [ecmfile]\n", argv[0]);
+    fprintf(stderr,
+            "usage: %s [--framed] [--no-container] [--store storefile] "
+            "[--hash crc32,md5,sha1] [--resume] cdimagefile [ecmfile]\n"
+            "       %s --analyze [--json] [--threads n] [--no-container] "
+            "cdimagefile\n"
+            "       %s --diff [--store storefile] ecmfile ecmfile\n",
+            argv[0], argv[0], argv[0]);
     return 1;
   }
   infilename = argv[1];
+  /* The hashes would miss everything before the checkpoint */
+  if (resuming && hashes) {
+    fprintf(stderr, "--resume cannot be combined with --hash\n");
+    return 1;
+  }
+  if (!image_hash_begin(hashes)) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
   /*
   ** Figure out what the output filename should be
   */
@@ -326,20 +603,59 @@ int main(int argc, char **argv) {
     perror(infilename);
     return 1;
   }
-  fout = fopen(outfilename, "wb");
+  if (resuming) {
+    if (!checkpoint_load(outfilename, &resume)) {
+      fclose(fin);
+      return 1;
+    }
+    fout = fopen(outfilename, "r+b");
+    if (fout && (!file_truncate(fout, resume.out) ||
+                 fseek(fout, resume.out, SEEK_SET))) {
+      fclose(fout);
+      fout = NULL;
+    }
+  } else {
+    fout = fopen(outfilename, "wb");
+  }
   if (!fout) {
     perror(outfilename);
     fclose(fin);
     return 1;
   }
+  if (storename) {
+    store = store_open_write(storename);
+    if (!store) {
+      fclose(fout);
+      fclose(fin);
+      return 1;
+    }
+  }
   /*
   ** Encode
   */
-  ecmify(fin, fout);
+  if (usetracks)
+    container = container_tracks(infilename, &tracks);
+  if (container)
+    fprintf(stderr, "Using %s track table (%u tracks)\n", container,
+            (unsigned)tracks.n);
+  if (ecmify(fin, fout, framesize, container ? &tracks : NULL, store,
+             outfilename, resuming ? &resume : NULL))
+    r = 1;
+  if (store && !store_close(store))
+    r = 1;
+  if (container)
+    container_free(&tracks);
+  if (hashes) {
+    struct image_digest digest;
+    image_hash_end(&digest);
+    digest_print(stdout, infilename, &digest);
+  }
   /*
   ** Close everything
   */
   fclose(fout);
   fclose(fin);
-  return 0;
+  if (!r)
+    checkpoint_remove(outfilename);
+  return r;
 }
@@ -0,0 +1,588 @@
+/***************************************************************************/
+/*
+** ECMD - Sector server for ECM (Error Code Modeler) files.
+** Version 1.0
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+/*
+** Serves reads of the original files of ECM files over a Unix socket, so
+** that several processes can share one decoder instead of each decoding
+** on its own or keeping a full image on disk.
+**
+** Each ECM file is opened once (by its real path) and only its record map
+** is kept in memory. Reads are served in blocks of 2352 bytes of the
+** original file, which are rebuilt on demand and kept in an LRU cache
+** shared by all clients. Large reads are answered with a memfd holding
+** the data, so the bytes never go through the socket.
+**
+** Clients are trusted: the daemon opens any path a client sends, with its
+** own rights. The socket is therefore made accessible to its owner only;
+** run one daemon per user, or put the socket in a directory whose
+** permissions say who may read through it.
+**
+** See ecmd.h for the protocol.
+*/
+/***************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "ecmd.h"
+#include "unecm.h"
+
+/* Bytes of the original file per cache block */
+#define BLOCK_SIZE SECTOR_1_SIZE
+/* Default cache size in MiB */
+#define CACHE_MB 64
+/* Open handles per connection */
+#define CLIENT_HANDLES 64
+
+/***************************************************************************/
+/*
+** Open ECM files, shared by all connections
+*/
+struct archive {
+  char *path; /* Real path */
+  int fd;
+  unsigned id; /* Cache key; never reused, so stale blocks just age out */
+  unsigned refs;
+  struct ecm_index index;
+  struct archive *next;
+};
+
+static pthread_mutex_t archive_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct archive *archives;
+static unsigned archive_ids;
+static struct sector_store *store;
+
+static bool archive_pread(void *ctx, uint64_t offset, uint8_t *buf,
+                          size_t size) {
+  const struct archive *a = ctx;
+  while (size) {
+    ssize_t n = pread(a->fd, buf, size, offset);
+    if (n <= 0) {
+      if ((n < 0) && (errno == EINTR))
+        continue;
+      return false;
+    }
+    buf += n;
+    offset += n;
+    size -= n;
+  }
+  return true;
+}
+
+/* Open an archive or take another reference; returns an errno value */
+static int archive_open(const char *path, struct archive **result) {
+  char *real = realpath(path, NULL);
+  struct archive *a;
+  FILE *f;
+  if (!real)
+    return errno;
+  pthread_mutex_lock(&archive_lock);
+  for (a = archives; a; a = a->next)
+    if (!strcmp(a->path, real))
+      break;
+  if (a) {
+    a->refs++;
+    pthread_mutex_unlock(&archive_lock);
+    free(real);
+    *result = a;
+    return 0;
+  }
+  /* Building the map under the lock keeps a file from being opened twice */
+  a = calloc(1, sizeof(*a));
+  f = fopen(real, "rb");
+  if (!a || !f) {
+    int e = a ? errno : ENOMEM;
+    pthread_mutex_unlock(&archive_lock);
+    if (f)
+      fclose(f);
+    free(a);
+    free(real);
+    return e;
+  }
+  if (!ecm_index_build(f, &a->index) ||
+      ((a->index.flags & ECM_FLAG_STORE) && !store)) {
+    fprintf(stderr, "%s: %s\n", real,
+            a->index.record ? "needs a sector store (--store)"
+                            : "not a valid ECM file");
+    pthread_mutex_unlock(&archive_lock);
+    ecm_index_free(&a->index);
+    fclose(f);
+    free(a);
+    free(real);
+    return EINVAL;
+  }
+  a->fd = dup(fileno(f));
+  fclose(f);
+  a->path = real;
+  a->id = ++archive_ids;
+  a->refs = 1;
+  a->next = archives;
+  archives = a;
+  pthread_mutex_unlock(&archive_lock);
+  fprintf(stderr, "Opened %s (%llu bytes, %lu records)\n", real,
+          (unsigned long long)a->index.size, (unsigned long)a->index.n);
+  *result = a;
+  return 0;
+}
+
+static void archive_close(struct archive *a) {
+  struct archive **p;
+  pthread_mutex_lock(&archive_lock);
+  if (--a->refs) {
+    pthread_mutex_unlock(&archive_lock);
+    return;
+  }
+  for (p = &archives; *p != a; p = &(*p)->next)
+    ;
+  *p = a->next;
+  pthread_mutex_unlock(&archive_lock);
+  close(a->fd);
+  ecm_index_free(&a->index);
+  free(a->path);
+  free(a);
+}
+
+/***************************************************************************/
+/*
+** LRU cache of blocks of original files, shared by all connections
+*/
+struct block {
+  unsigned archive;
+  uint64_t n;
+  uint32_t size;
+  struct block *hnext;       /* Hash chain */
+  struct block *prev, *next; /* LRU list, most recent first */
+  uint8_t data[BLOCK_SIZE];
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct block *cache_blocks;
+static struct block **cache_hash;
+static size_t cache_buckets;
+static struct block cache_lru; /* List head */
+
+static bool cache_init(size_t megabytes) {
+  size_t count = megabytes * 0x100000 / sizeof(struct block), i;
+  if (!count)
+    count = 1;
+  for (cache_buckets = 1; cache_buckets < count; cache_buckets *= 2)
+    ;
+  cache_blocks = calloc(count, sizeof(*cache_blocks));
+  cache_hash = calloc(cache_buckets, sizeof(*cache_hash));
+  if (!cache_blocks || !cache_hash)
+    return false;
+  /* Every block starts on the LRU list, unused (size 0) */
+  cache_lru.prev = cache_lru.next = &cache_lru;
+  for (i = 0; i < count; i++) {
+    struct block *b = &cache_blocks[i];
+    b->next = cache_lru.next;
+    b->prev = &cache_lru;
+    cache_lru.next->prev = b;
+    cache_lru.next = b;
+  }
+  return true;
+}
+
+static struct block **cache_bucket(unsigned archive, uint64_t n) {
+  uint64_t h = (n * 0x9E3779B97F4A7C15ULL) ^ archive;
+  return &cache_hash[(h ^ (h >> 29)) & (cache_buckets - 1)];
+}
+
+static void lru_unlink(struct block *b) {
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+}
+
+static void lru_push(struct block *b) {
+  b->next = cache_lru.next;
+  b->prev = &cache_lru;
+  cache_lru.next->prev = b;
+  cache_lru.next = b;
+}
+
+/* Copy a cached block to data; returns its size, or 0 if not cached */
+static uint32_t cache_get(unsigned archive, uint64_t n, uint8_t *data) {
+  struct block *b;
+  uint32_t size = 0;
+  pthread_mutex_lock(&cache_lock);
+  for (b = *cache_bucket(archive, n); b; b = b->hnext)
+    if ((b->archive == archive) && (b->n == n))
+      break;
+  if (b) {
+    lru_unlink(b);
+    lru_push(b);
+    memcpy(data, b->data, b->size);
+    size = b->size;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return size;
+}
+
+static void cache_put(unsigned archive, uint64_t n, const uint8_t *data,
+                      uint32_t size) {
+  struct block *b, **p;
+  pthread_mutex_lock(&cache_lock);
+  /* Another connection may have rebuilt the same block meanwhile */
+  for (b = *cache_bucket(archive, n); b; b = b->hnext)
+    if ((b->archive == archive) && (b->n == n))
+      break;
+  if (!b) {
+    b = cache_lru.prev;
+    if (b->size) {
+      for (p = cache_bucket(b->archive, b->n); *p != b; p = &(*p)->hnext)
+        ;
+      *p = b->hnext;
+    }
+    b->archive = archive;
+    b->n = n;
+    b->size = size;
+    memcpy(b->data, data, size);
+    p = cache_bucket(archive, n);
+    b->hnext = *p;
+    *p = b;
+  }
+  lru_unlink(b);
+  lru_push(b);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/* Rebuild size bytes of an archive's original file at offset */
+static bool archive_read(struct archive *a, uint64_t offset, uint8_t *buf,
+                         size_t size) {
+  struct ecm_source source;
+  uint8_t block[BLOCK_SIZE];
+  source.read = archive_pread;
+  source.ctx = a;
+  while (size) {
+    uint64_t n = offset / BLOCK_SIZE;
+    uint32_t skip = offset % BLOCK_SIZE;
+    uint32_t have = cache_get(a->id, n, block);
+    size_t take;
+    if (!have) {
+      have = BLOCK_SIZE;
+      if (a->index.size - n * BLOCK_SIZE < have)
+        have = a->index.size - n * BLOCK_SIZE;
+      if (!ecm_index_read(&a->index, &source, store, n * BLOCK_SIZE, block,
+                          have))
+        return false;
+      cache_put(a->id, n, block, have);
+    }
+    take = have - skip;
+    if (take > size)
+      take = size;
+    memcpy(buf, block + skip, take);
+    buf += take;
+    offset += take;
+    size -= take;
+  }
+  return true;
+}
+
+/***************************************************************************/
+/*
+** Connections
+*/
+static bool recv_all(int sock, void *data, size_t size) {
+  uint8_t *p = data;
+  while (size) {
+    ssize_t n = recv(sock, p, size, 0);
+    if ((n < 0) && (errno == EINTR))
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+static bool send_all(int sock, const void *data, size_t size) {
+  const uint8_t *p = data;
+  while (size) {
+    ssize_t n = send(sock, p, size, MSG_NOSIGNAL);
+    if ((n < 0) && (errno == EINTR))
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+/* Send a response header, with a descriptor if fd is not -1 */
+static bool respond(int sock, uint32_t status, uint32_t handle,
+                    uint64_t value, uint32_t length, int fd) {
+  uint8_t header[ECMD_HEADER_SIZE];
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr msg;
+  struct iovec iov;
+  ssize_t n;
+  put_le32(header + 0, status);
+  put_le32(header + 4, handle);
+  put_le32(header + 8, (uint32_t)value);
+  put_le32(header + 12, (uint32_t)(value >> 32));
+  put_le32(header + 16, length);
+  put_le32(header + 20, fd >= 0 ? ECMD_FLAG_FD : 0);
+  if (fd < 0)
+    return send_all(sock, header, sizeof(header));
+  memset(&msg, 0, sizeof(msg));
+  memset(&control, 0, sizeof(control));
+  iov.iov_base = header;
+  iov.iov_len = sizeof(header);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  CMSG_FIRSTHDR(&msg)->cmsg_level = SOL_SOCKET;
+  CMSG_FIRSTHDR(&msg)->cmsg_type = SCM_RIGHTS;
+  CMSG_FIRSTHDR(&msg)->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(CMSG_FIRSTHDR(&msg)), &fd, sizeof(int));
+  do
+    n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  while ((n < 0) && (errno == EINTR));
+  if (n <= 0)
+    return false;
+  return send_all(sock, header + n, sizeof(header) - n);
+}
+
+/* Answer ECMD_READ; returns false if the connection is lost */
+static bool serve_read(int sock, uint32_t handle, struct archive *a,
+                       uint64_t offset, uint32_t length, uint32_t flags) {
+  uint8_t *data;
+  bool ok;
+  int fd;
+  if (length > ECMD_READ_MAX)
+    return respond(sock, EINVAL, handle, 0, 0, -1);
+  if (offset >= a->index.size)
+    length = 0;
+  else if (a->index.size - offset < length)
+    length = a->index.size - offset;
+  if (!(flags & ECMD_FLAG_FD) && (length <= ECMD_INLINE_MAX)) {
+    data = malloc(length ? length : 1);
+    if (!data)
+      return respond(sock, ENOMEM, handle, 0, 0, -1);
+    if (!archive_read(a, offset, data, length)) {
+      free(data);
+      return respond(sock, EIO, handle, 0, 0, -1);
+    }
+    ok = respond(sock, 0, handle, 0, length, -1) &&
+         send_all(sock, data, length);
+    free(data);
+    return ok;
+  }
+  fd = memfd_create("ecmd", MFD_CLOEXEC);
+  if ((fd < 0) || ftruncate(fd, length)) {
+    if (fd >= 0)
+      close(fd);
+    return respond(sock, ENOMEM, handle, 0, 0, -1);
+  }
+  data = length ? mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                       0)
+                : NULL;
+  if (data == MAP_FAILED) {
+    close(fd);
+    return respond(sock, ENOMEM, handle, 0, 0, -1);
+  }
+  ok = archive_read(a, offset, data, length);
+  if (data)
+    munmap(data, length);
+  ok = ok ? respond(sock, 0, handle, 0, length, fd)
+          : respond(sock, EIO, handle, 0, 0, -1);
+  close(fd);
+  return ok;
+}
+
+static void *connection(void *arg) {
+  int sock = (int)(intptr_t)arg;
+  struct archive *handle[CLIENT_HANDLES];
+  char path[ECMD_PATH_MAX + 1];
+  unsigned i;
+  memset(handle, 0, sizeof(handle));
+  for (;;) {
+    uint8_t header[ECMD_HEADER_SIZE];
+    uint32_t op, h, length, flags;
+    uint64_t offset;
+    bool ok = false;
+    if (!recv_all(sock, header, sizeof(header)))
+      break;
+    op = get_le32(header + 0);
+    h = get_le32(header + 4);
+    offset = get_le32(header + 8) | ((uint64_t)get_le32(header + 12) << 32);
+    length = get_le32(header + 16);
+    flags = get_le32(header + 20);
+    if ((op != ECMD_OPEN) && ((h >= CLIENT_HANDLES) || !handle[h])) {
+      ok = respond(sock, EBADF, h, 0, 0, -1);
+    } else if (op == ECMD_OPEN) {
+      struct archive *a = NULL;
+      int e;
+      if (length > ECMD_PATH_MAX)
+        break;
+      if (!recv_all(sock, path, length))
+        break;
+      path[length] = 0;
+      for (h = 0; (h < CLIENT_HANDLES) && handle[h]; h++)
+        ;
+      if (h == CLIENT_HANDLES)
+        e = EMFILE;
+      else
+        e = archive_open(path, &a);
+      if (e) {
+        ok = respond(sock, e, 0, 0, 0, -1);
+      } else {
+        handle[h] = a;
+        ok = respond(sock, 0, h, a->index.size, 0, -1);
+      }
+    } else if (op == ECMD_READ) {
+      ok = serve_read(sock, h, handle[h], offset, length, flags);
+    } else if (op == ECMD_CLOSE) {
+      archive_close(handle[h]);
+      handle[h] = NULL;
+      ok = respond(sock, 0, h, 0, 0, -1);
+    } else {
+      ok = respond(sock, EINVAL, h, 0, 0, -1);
+    }
+    if (!ok)
+      break;
+  }
+  for (i = 0; i < CLIENT_HANDLES; i++)
+    if (handle[i])
+      archive_close(handle[i]);
+  close(sock);
+  return NULL;
+}
+
+/***************************************************************************/
+
+static const char *socketpath;
+
+static void quit(int sig) {
+  unlink(socketpath);
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+int main(int argc, char **argv) {
+  struct sockaddr_un addr;
+  const char *storename = NULL;
+  size_t cachemb = CACHE_MB;
+  int listener;
+
+  fprintf(stderr, "ECMD - Sector server for Error Code Modeler format v1.0\n"
+                  "\n");
+
+  /*
+  ** Initialize the ECC/EDC tables
+  */
+  eccedc_init();
+  /*
+  ** Check command line
+  */
+  while (argc >= 3) {
+    if (!strcasecmp(argv[1], "--store")) {
+      storename = argv[2];
+    } else if (!strcasecmp(argv[1], "--cache")) {
+      cachemb = strtoul(argv[2], NULL, 10);
+    } else {
+      break;
+    }
+    argv[2] = argv[0];
+    argc -= 2;
+    argv += 2;
+  }
+  if (argc != 2) {
+    fprintf(stderr,
+            "usage: %s [--store storefile] [--cache megabytes] socketpath\n",
+            argv[0]);
+    return 1;
+  }
+  socketpath = argv[1];
+  if (strlen(socketpath) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "socket path '%s' is too long\n", socketpath);
+    return 1;
+  }
+  if (!cache_init(cachemb)) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  if (storename) {
+    store = store_open_read(storename);
+    if (!store)
+      return 1;
+  }
+  /*
+  ** Listen
+  */
+  listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0) {
+    perror("socket");
+    return 1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socketpath);
+  /* A socket left behind by an earlier run would make bind() fail */
+  unlink(socketpath);
+  /* Owner only, before anyone can connect; see the top of this file */
+  if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) ||
+      chmod(socketpath, S_IRUSR | S_IWUSR) ||
+      listen(listener, SOMAXCONN)) {
+    perror(socketpath);
+    return 1;
+  }
+  signal(SIGINT, quit);
+  signal(SIGTERM, quit);
+  signal(SIGPIPE, SIG_IGN);
+  fprintf(stderr, "Listening on %s (%lu MiB cache)\n", socketpath,
+          (unsigned long)cachemb);
+  for (;;) {
+    pthread_t thread;
+    int sock = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    if (sock < 0) {
+      if ((errno == EINTR) || (errno == ECONNABORTED))
+        continue;
+      perror("accept");
+      break;
+    }
+    if (pthread_create(&thread, NULL, connection, (void *)(intptr_t)sock)) {
+      close(sock);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+  unlink(socketpath);
+  return 1;
+}
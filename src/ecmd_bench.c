@@ -0,0 +1,148 @@
+/***************************************************************************/
+/*
+** ECMD - Sector server for ECM (Error Code Modeler) files.
+** Version 1.0
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+/*
+** Load generator for ecmd: a number of client processes each make random
+** sector-aligned reads of an ECM file through the daemon.
+*/
+/***************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "ecmd.h"
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* One client: returns 0 if every read succeeded */
+static int client(const char *socketpath, const char *ecmfile,
+                  unsigned reads, size_t size, bool map, unsigned seed) {
+  struct ecmd_client *c = ecmd_connect(socketpath);
+  uint64_t imagesize, sectors;
+  uint8_t *buf = malloc(size);
+  unsigned i;
+  int h;
+  if (!c || !buf) {
+    perror(socketpath);
+    return 1;
+  }
+  h = ecmd_open(c, ecmfile, &imagesize);
+  if (h < 0) {
+    perror(ecmfile);
+    return 1;
+  }
+  sectors = imagesize / ECMD_SECTOR_SIZE;
+  if (!sectors)
+    sectors = 1;
+  for (i = 0; i < reads; i++) {
+    uint64_t lba = (uint64_t)rand_r(&seed) * RAND_MAX + rand_r(&seed);
+    uint64_t offset = (lba % sectors) * ECMD_SECTOR_SIZE;
+    if (map) {
+      size_t got = 0;
+      const void *data = ecmd_map(c, h, offset, size, &got);
+      /* Past the end of the image there is nothing to map (errno 0) */
+      if (!data && (got || errno)) {
+        perror("ecmd_map");
+        return 1;
+      }
+      if (data)
+        ecmd_unmap(data, got);
+    } else if (ecmd_read(c, h, offset, buf, size) < 0) {
+      perror("ecmd_read");
+      return 1;
+    }
+  }
+  ecmd_close(c, h);
+  ecmd_disconnect(c);
+  free(buf);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  unsigned clients = 4;
+  unsigned reads = 10000;
+  size_t size = ECMD_SECTOR_SIZE;
+  bool map = false;
+  unsigned i, failed = 0;
+  double start, elapsed;
+
+  while (argc >= 2) {
+    if (!strcasecmp(argv[1], "--clients") && (argc >= 3)) {
+      clients = strtoul(argv[2], NULL, 10);
+    } else if (!strcasecmp(argv[1], "--reads") && (argc >= 3)) {
+      reads = strtoul(argv[2], NULL, 10);
+    } else if (!strcasecmp(argv[1], "--size") && (argc >= 3)) {
+      size = strtoul(argv[2], NULL, 10);
+    } else if (!strcasecmp(argv[1], "--map")) {
+      map = true;
+      argv[1] = argv[0];
+      argc--;
+      argv++;
+      continue;
+    } else {
+      break;
+    }
+    argv[2] = argv[0];
+    argc -= 2;
+    argv += 2;
+  }
+  if ((argc != 3) || !clients || !size) {
+    fprintf(stderr,
+            "usage: %s [--clients n] [--reads n] [--size bytes] [--map] "
+            "socketpath ecmfile\n",
+            argv[0]);
+    return 1;
+  }
+  start = now();
+  for (i = 0; i < clients; i++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      return 1;
+    }
+    if (!pid)
+      _exit(client(argv[1], argv[2], reads, size, map, i + 1));
+  }
+  for (i = 0; i < clients; i++) {
+    int status;
+    if ((wait(&status) < 0) || !WIFEXITED(status) || WEXITSTATUS(status))
+      failed++;
+  }
+  elapsed = now() - start;
+  printf("%u clients x %u reads of %lu bytes%s in %.3f seconds\n", clients,
+         reads, (unsigned long)size, map ? " (mapped)" : "", elapsed);
+  printf("%.0f reads/s, %.1f MiB/s\n", clients * reads / elapsed,
+         clients * (double)reads * size / elapsed / 0x100000);
+  if (failed)
+    printf("%u clients failed\n", failed);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,270 @@
+/***************************************************************************/
+/*
+** ECMD - Sector server for ECM (Error Code Modeler) files.
+** Version 1.0
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+/*
+** Client library for ecmd
+*/
+/***************************************************************************/
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "byteorder.h"
+#include "ecmd.h"
+
+struct ecmd_client {
+  int sock;
+};
+
+struct ecmd_response {
+  uint32_t status;
+  uint32_t handle;
+  uint64_t value;
+  uint32_t length;
+  uint32_t flags;
+  int fd; /* -1 unless ECMD_FLAG_FD */
+};
+
+static int send_all(int sock, const void *data, size_t size) {
+  const uint8_t *p = data;
+  while (size) {
+    ssize_t n = send(sock, p, size, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += n;
+    size -= n;
+  }
+  return 0;
+}
+
+static int recv_all(int sock, void *data, size_t size) {
+  uint8_t *p = data;
+  while (size) {
+    ssize_t n = recv(sock, p, size, 0);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (!n) {
+      errno = ECONNRESET;
+      return -1;
+    }
+    p += n;
+    size -= n;
+  }
+  return 0;
+}
+
+/* Send a request and wait for its response header */
+static int transact(struct ecmd_client *client, uint32_t op, uint32_t handle,
+                    uint64_t offset, uint32_t length, uint32_t flags,
+                    const void *data, struct ecmd_response *r) {
+  uint8_t header[ECMD_HEADER_SIZE];
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  ssize_t n;
+  put_le32(header + 0, op);
+  put_le32(header + 4, handle);
+  put_le32(header + 8, (uint32_t)offset);
+  put_le32(header + 12, (uint32_t)(offset >> 32));
+  put_le32(header + 16, length);
+  put_le32(header + 20, flags);
+  if (send_all(client->sock, header, sizeof(header)) ||
+      (data && send_all(client->sock, data, length)))
+    return -1;
+  /* The descriptor, if any, comes with the first byte of the response */
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = header;
+  iov.iov_len = sizeof(header);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  do
+    n = recvmsg(client->sock, &msg, MSG_CMSG_CLOEXEC);
+  while ((n < 0) && (errno == EINTR));
+  if (n <= 0) {
+    if (!n)
+      errno = ECONNRESET;
+    return -1;
+  }
+  r->fd = -1;
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS))
+      memcpy(&r->fd, CMSG_DATA(cmsg), sizeof(int));
+  if (((size_t)n < sizeof(header)) &&
+      recv_all(client->sock, header + n, sizeof(header) - n)) {
+    if (r->fd >= 0)
+      close(r->fd);
+    return -1;
+  }
+  r->status = get_le32(header + 0);
+  r->handle = get_le32(header + 4);
+  r->value = get_le32(header + 8) | ((uint64_t)get_le32(header + 12) << 32);
+  r->length = get_le32(header + 16);
+  r->flags = get_le32(header + 20);
+  if (r->status) {
+    if (r->fd >= 0)
+      close(r->fd);
+    errno = r->status;
+    return -1;
+  }
+  if ((r->flags & ECMD_FLAG_FD) && (r->fd < 0)) {
+    errno = EPROTO;
+    return -1;
+  }
+  return 0;
+}
+
+struct ecmd_client *ecmd_connect(const char *socketpath) {
+  struct ecmd_client *client;
+  struct sockaddr_un addr;
+  if (strlen(socketpath) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  client = malloc(sizeof(*client));
+  if (!client)
+    return NULL;
+  client->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (client->sock < 0) {
+    free(client);
+    return NULL;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socketpath);
+  if (connect(client->sock, (struct sockaddr *)&addr, sizeof(addr))) {
+    int e = errno;
+    close(client->sock);
+    free(client);
+    errno = e;
+    return NULL;
+  }
+  return client;
+}
+
+void ecmd_disconnect(struct ecmd_client *client) {
+  close(client->sock);
+  free(client);
+}
+
+int ecmd_open(struct ecmd_client *client, const char *path, uint64_t *size) {
+  struct ecmd_response r;
+  size_t len = strlen(path);
+  if (len > ECMD_PATH_MAX) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  if (transact(client, ECMD_OPEN, 0, 0, len, 0, path, &r))
+    return -1;
+  if (size)
+    *size = r.value;
+  return r.handle;
+}
+
+int ecmd_close(struct ecmd_client *client, int handle) {
+  struct ecmd_response r;
+  return transact(client, ECMD_CLOSE, handle, 0, 0, 0, NULL, &r);
+}
+
+long ecmd_read(struct ecmd_client *client, int handle, uint64_t offset,
+               void *buf, size_t size) {
+  uint8_t *p = buf;
+  long done = 0;
+  while (size) {
+    struct ecmd_response r;
+    uint32_t n = size < ECMD_READ_MAX ? size : ECMD_READ_MAX;
+    if (transact(client, ECMD_READ, handle, offset, n, 0, NULL, &r))
+      return -1;
+    if (r.fd >= 0) {
+      ssize_t got = pread(r.fd, p, r.length, 0);
+      close(r.fd);
+      if (got != (ssize_t)r.length) {
+        errno = EIO;
+        return -1;
+      }
+    } else if (recv_all(client->sock, p, r.length)) {
+      return -1;
+    }
+    done += r.length;
+    if (r.length < n)
+      break;
+    p += n;
+    offset += n;
+    size -= n;
+  }
+  return done;
+}
+
+long ecmd_read_sectors(struct ecmd_client *client, int handle, uint32_t lba,
+                       unsigned count, void *buf) {
+  long n = ecmd_read(client, handle, (uint64_t)lba * ECMD_SECTOR_SIZE, buf,
+                     (size_t)count * ECMD_SECTOR_SIZE);
+  return n < 0 ? n : n / ECMD_SECTOR_SIZE;
+}
+
+const void *ecmd_map(struct ecmd_client *client, int handle, uint64_t offset,
+                     size_t size, size_t *got) {
+  struct ecmd_response r;
+  void *data;
+  *got = 0;
+  if (size > ECMD_READ_MAX) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (transact(client, ECMD_READ, handle, offset, size, ECMD_FLAG_FD, NULL,
+               &r))
+    return NULL;
+  if (r.fd < 0) {
+    errno = EPROTO;
+    return NULL;
+  }
+  *got = r.length;
+  if (!r.length) {
+    close(r.fd);
+    errno = 0;
+    return NULL;
+  }
+  data = mmap(NULL, r.length, PROT_READ, MAP_SHARED, r.fd, 0);
+  close(r.fd);
+  return data == MAP_FAILED ? NULL : data;
+}
+
+void ecmd_unmap(const void *data, size_t size) {
+  munmap((void *)data, size);
+}
@@ -0,0 +1,568 @@
+/***************************************************************************/
+/*
+** ECM - Encoder for ECM (Error Code Modeler) format.
+** Version 1.0
+** Copyright (C) 2002 Neill Corlett
+** Copyright (c) 2020-2023 Azamat H. Hackimov
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+/*
+** CRC-32, MD5 and SHA-1 of the original image, computed while encoding or
+** decoding. The bytes are handed to a helper thread in large blocks so
+** that hashing does not hold up the main loop.
+*/
+/***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unecm.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HASH_THREAD
+#include <pthread.h>
+#endif
+
+/* Blocks queued for the helper thread */
+#define HASH_BLOCK_SIZE 0x100000
+#define HASH_BLOCKS 4
+
+/***************************************************************************/
+/*
+** MD5 (RFC 1321)
+*/
+struct md5_ctx {
+  uint32_t state[4];
+  uint64_t size;
+  uint8_t buf[64];
+};
+
+static const uint32_t md5_k[64] = {
+    0xD76AA478, 0xE8C7B756, 0x242070DB, 0xC1BDCEEE, 0xF57C0FAF, 0x4787C62A,
+    0xA8304613, 0xFD469501, 0x698098D8, 0x8B44F7AF, 0xFFFF5BB1, 0x895CD7BE,
+    0x6B901122, 0xFD987193, 0xA679438E, 0x49B40821, 0xF61E2562, 0xC040B340,
+    0x265E5A51, 0xE9B6C7AA, 0xD62F105D, 0x02441453, 0xD8A1E681, 0xE7D3FBC8,
+    0x21E1CDE6, 0xC33707D6, 0xF4D50D87, 0x455A14ED, 0xA9E3E905, 0xFCEFA3F8,
+    0x676F02D9, 0x8D2A4C8A, 0xFFFA3942, 0x8771F681, 0x6D9D6122, 0xFDE5380C,
+    0xA4BEEA44, 0x4BDECFA9, 0xF6BB4B60, 0xBEBFBC70, 0x289B7EC6, 0xEAA127FA,
+    0xD4EF3085, 0x04881D05, 0xD9D4D039, 0xE6DB99E5, 0x1FA27CF8, 0xC4AC5665,
+    0xF4292244, 0x432AFF97, 0xAB9423A7, 0xFC93A039, 0x655B59C3, 0x8F0CCC92,
+    0xFFEFF47D, 0x85845DD1, 0x6FA87E4F, 0xFE2CE6E0, 0xA3014314, 0x4E0811A1,
+    0xF7537E82, 0xBD3AF235, 0x2AD7D2BB, 0xEB86D391};
+
+static const uint8_t md5_r[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5, 9,  14, 20, 5, 9,  14, 20, 5, 9,  14, 20, 5, 9,  14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21};
+
+static uint32_t rol32(uint32_t x, unsigned n) {
+  return (x << n) | (x >> (32 - n));
+}
+
+static void md5_block(struct md5_ctx *ctx, const uint8_t *p) {
+  uint32_t w[16], a, b, c, d;
+  unsigned i;
+  for (i = 0; i < 16; i++)
+    w[i] = p[i * 4] | ((uint32_t)p[i * 4 + 1] << 8) |
+           ((uint32_t)p[i * 4 + 2] << 16) | ((uint32_t)p[i * 4 + 3] << 24);
+  a = ctx->state[0];
+  b = ctx->state[1];
+  c = ctx->state[2];
+  d = ctx->state[3];
+  for (i = 0; i < 64; i++) {
+    uint32_t f, t;
+    unsigned g;
+    if (i < 16) {
+      f = (b & c) | (~b & d);
+      g = i;
+    } else if (i < 32) {
+      f = (d & b) | (~d & c);
+      g = (5 * i + 1) & 15;
+    } else if (i < 48) {
+      f = b ^ c ^ d;
+      g = (3 * i + 5) & 15;
+    } else {
+      f = c ^ (b | ~d);
+      g = (7 * i) & 15;
+    }
+    t = d;
+    d = c;
+    c = b;
+    b = b + rol32(a + f + md5_k[i] + w[g], md5_r[i]);
+    a = t;
+  }
+  ctx->state[0] += a;
+  ctx->state[1] += b;
+  ctx->state[2] += c;
+  ctx->state[3] += d;
+}
+
+static void md5_init(struct md5_ctx *ctx) {
+  ctx->state[0] = 0x67452301;
+  ctx->state[1] = 0xEFCDAB89;
+  ctx->state[2] = 0x98BADCFE;
+  ctx->state[3] = 0x10325476;
+  ctx->size = 0;
+}
+
+static void md5_update(struct md5_ctx *ctx, const uint8_t *data, size_t size) {
+  unsigned have = ctx->size & 63;
+  ctx->size += size;
+  if (have) {
+    unsigned n = 64 - have;
+    if (n > size)
+      n = size;
+    memcpy(ctx->buf + have, data, n);
+    data += n;
+    size -= n;
+    if (have + n < 64)
+      return;
+    md5_block(ctx, ctx->buf);
+  }
+  for (; size >= 64; data += 64, size -= 64)
+    md5_block(ctx, data);
+  memcpy(ctx->buf, data, size);
+}
+
+static void md5_final(struct md5_ctx *ctx, uint8_t *digest) {
+  uint64_t bits = ctx->size * 8;
+  uint8_t pad[72];
+  unsigned n = 64 - (ctx->size & 63), i;
+  if (n < 9)
+    n += 64;
+  memset(pad, 0, sizeof(pad));
+  pad[0] = 0x80;
+  for (i = 0; i < 8; i++)
+    pad[n - 8 + i] = (bits >> (8 * i)) & 0xFF;
+  md5_update(ctx, pad, n);
+  for (i = 0; i < 16; i++)
+    digest[i] = (ctx->state[i / 4] >> (8 * (i % 4))) & 0xFF;
+}
+
+/***************************************************************************/
+/*
+** SHA-1 (FIPS 180-4)
+*/
+struct sha1_ctx {
+  uint32_t state[5];
+  uint64_t size;
+  uint8_t buf[64];
+};
+
+static void sha1_block(struct sha1_ctx *ctx, const uint8_t *p) {
+  uint32_t w[80], a, b, c, d, e;
+  unsigned i;
+  for (i = 0; i < 16; i++)
+    w[i] = ((uint32_t)p[i * 4] << 24) | ((uint32_t)p[i * 4 + 1] << 16) |
+           ((uint32_t)p[i * 4 + 2] << 8) | p[i * 4 + 3];
+  for (; i < 80; i++)
+    w[i] = rol32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+  a = ctx->state[0];
+  b = ctx->state[1];
+  c = ctx->state[2];
+  d = ctx->state[3];
+  e = ctx->state[4];
+  for (i = 0; i < 80; i++) {
+    uint32_t f, k, t;
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5A827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ED9EBA1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8F1BBCDC;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xCA62C1D6;
+    }
+    t = rol32(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = rol32(b, 30);
+    b = a;
+    a = t;
+  }
+  ctx->state[0] += a;
+  ctx->state[1] += b;
+  ctx->state[2] += c;
+  ctx->state[3] += d;
+  ctx->state[4] += e;
+}
+
+static void sha1_init(struct sha1_ctx *ctx) {
+  ctx->state[0] = 0x67452301;
+  ctx->state[1] = 0xEFCDAB89;
+  ctx->state[2] = 0x98BADCFE;
+  ctx->state[3] = 0x10325476;
+  ctx->state[4] = 0xC3D2E1F0;
+  ctx->size = 0;
+}
+
+static void sha1_update(struct sha1_ctx *ctx, const uint8_t *data,
+                        size_t size) {
+  unsigned have = ctx->size & 63;
+  ctx->size += size;
+  if (have) {
+    unsigned n = 64 - have;
+    if (n > size)
+      n = size;
+    memcpy(ctx->buf + have, data, n);
+    data += n;
+    size -= n;
+    if (have + n < 64)
+      return;
+    sha1_block(ctx, ctx->buf);
+  }
+  for (; size >= 64; data += 64, size -= 64)
+    sha1_block(ctx, data);
+  memcpy(ctx->buf, data, size);
+}
+
+static void sha1_final(struct sha1_ctx *ctx, uint8_t *digest) {
+  uint64_t bits = ctx->size * 8;
+  uint8_t pad[72];
+  unsigned n = 64 - (ctx->size & 63), i;
+  if (n < 9)
+    n += 64;
+  memset(pad, 0, sizeof(pad));
+  pad[0] = 0x80;
+  for (i = 0; i < 8; i++)
+    pad[n - 1 - i] = (bits >> (8 * i)) & 0xFF;
+  sha1_update(ctx, pad, n);
+  for (i = 0; i < 20; i++)
+    digest[i] = (ctx->state[i / 4] >> (24 - 8 * (i % 4))) & 0xFF;
+}
+
+void sha1_compute(const uint8_t *data, size_t size, uint8_t *digest) {
+  struct sha1_ctx ctx;
+  sha1_init(&ctx);
+  sha1_update(&ctx, data, size);
+  sha1_final(&ctx, digest);
+}
+
+/***************************************************************************/
+/*
+** Image hasher; one at a time, fed through image_hash()
+*/
+struct hasher {
+  unsigned which;
+  uint64_t size;
+  uint32_t crc;
+  struct md5_ctx md5;
+  struct sha1_ctx sha1;
+  uint8_t *block[HASH_BLOCKS];
+  size_t fill[HASH_BLOCKS];
+  unsigned head;  /* Block being filled */
+  unsigned tail;  /* Next block to hash */
+  unsigned count; /* Blocks queued */
+  bool done;
+#ifdef HASH_THREAD
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+#endif
+};
+
+static struct hasher *hasher;
+
+static void hasher_consume(struct hasher *h, const uint8_t *data,
+                           size_t size) {
+  if (h->which & HASH_CRC32)
+    h->crc = crc32_computeblock(h->crc, data, size);
+  if (h->which & HASH_MD5)
+    md5_update(&h->md5, data, size);
+  if (h->which & HASH_SHA1)
+    sha1_update(&h->sha1, data, size);
+}
+
+#ifdef HASH_THREAD
+
+static void *hasher_thread(void *arg) {
+  struct hasher *h = arg;
+  pthread_mutex_lock(&h->lock);
+  for (;;) {
+    unsigned tail;
+    while (!h->count && !h->done)
+      pthread_cond_wait(&h->cond, &h->lock);
+    if (!h->count)
+      break;
+    tail = h->tail;
+    pthread_mutex_unlock(&h->lock);
+    hasher_consume(h, h->block[tail], h->fill[tail]);
+    pthread_mutex_lock(&h->lock);
+    h->fill[tail] = 0;
+    h->tail = (tail + 1) % HASH_BLOCKS;
+    h->count--;
+    pthread_cond_broadcast(&h->cond);
+  }
+  pthread_mutex_unlock(&h->lock);
+  return NULL;
+}
+
+/* Queue the block being filled and wait for a free one */
+static void hasher_submit(struct hasher *h) {
+  pthread_mutex_lock(&h->lock);
+  h->count++;
+  h->head = (h->head + 1) % HASH_BLOCKS;
+  pthread_cond_broadcast(&h->cond);
+  while (h->count == HASH_BLOCKS)
+    pthread_cond_wait(&h->cond, &h->lock);
+  pthread_mutex_unlock(&h->lock);
+}
+
+#endif
+
+bool image_hash_begin(unsigned which) {
+  struct hasher *h;
+  unsigned i;
+  if (!which)
+    return true;
+  h = calloc(1, sizeof(*h));
+  if (!h)
+    return false;
+  h->which = which;
+  md5_init(&h->md5);
+  sha1_init(&h->sha1);
+#ifdef HASH_THREAD
+  for (i = 0; i < HASH_BLOCKS; i++) {
+    h->block[i] = malloc(HASH_BLOCK_SIZE);
+    if (!h->block[i])
+      goto fail;
+  }
+  pthread_mutex_init(&h->lock, NULL);
+  pthread_cond_init(&h->cond, NULL);
+  if (pthread_create(&h->thread, NULL, hasher_thread, h)) {
+    pthread_cond_destroy(&h->cond);
+    pthread_mutex_destroy(&h->lock);
+    goto fail;
+  }
+#else
+  (void)i;
+#endif
+  hasher = h;
+  return true;
+#ifdef HASH_THREAD
+fail:
+  for (i = 0; i < HASH_BLOCKS; i++)
+    free(h->block[i]);
+  free(h);
+  return false;
+#endif
+}
+
+void image_hash(const uint8_t *data, size_t size) {
+  struct hasher *h = hasher;
+  if (!h)
+    return;
+  h->size += size;
+#ifdef HASH_THREAD
+  while (size) {
+    size_t n = HASH_BLOCK_SIZE - h->fill[h->head];
+    if (n > size)
+      n = size;
+    memcpy(h->block[h->head] + h->fill[h->head], data, n);
+    h->fill[h->head] += n;
+    data += n;
+    size -= n;
+    if (h->fill[h->head] == HASH_BLOCK_SIZE)
+      hasher_submit(h);
+  }
+#else
+  hasher_consume(h, data, size);
+#endif
+}
+
+bool image_hash_end(struct image_digest *digest) {
+  struct hasher *h = hasher;
+  unsigned i;
+  memset(digest, 0, sizeof(*digest));
+  if (!h)
+    return false;
+  hasher = NULL;
+#ifdef HASH_THREAD
+  pthread_mutex_lock(&h->lock);
+  if (h->fill[h->head]) {
+    h->count++;
+    h->head = (h->head + 1) % HASH_BLOCKS;
+  }
+  h->done = true;
+  pthread_cond_broadcast(&h->cond);
+  pthread_mutex_unlock(&h->lock);
+  pthread_join(h->thread, NULL);
+  pthread_cond_destroy(&h->cond);
+  pthread_mutex_destroy(&h->lock);
+  for (i = 0; i < HASH_BLOCKS; i++)
+    free(h->block[i]);
+#else
+  (void)i;
+#endif
+  digest->which = h->which;
+  digest->size = h->size;
+  digest->crc32 = h->crc;
+  md5_final(&h->md5, digest->md5);
+  sha1_final(&h->sha1, digest->sha1);
+  free(h);
+  return true;
+}
+
+/***************************************************************************/
+
+unsigned hash_parse(const char *list) {
+  unsigned which = 0;
+  while (*list) {
+    size_t len = strcspn(list, ",");
+    if ((len == 3) && !strncasecmp(list, "all", 3))
+      which |= HASH_CRC32 | HASH_MD5 | HASH_SHA1;
+    else if (((len == 5) && !strncasecmp(list, "crc32", 5)) ||
+             ((len == 3) && !strncasecmp(list, "crc", 3)))
+      which |= HASH_CRC32;
+    else if ((len == 3) && !strncasecmp(list, "md5", 3))
+      which |= HASH_MD5;
+    else if (((len == 4) && !strncasecmp(list, "sha1", 4)) ||
+             ((len == 5) && !strncasecmp(list, "sha-1", 5)))
+      which |= HASH_SHA1;
+    else
+      return 0;
+    list += len;
+    if (*list)
+      list++;
+  }
+  return which;
+}
+
+static void hex(char *out, const uint8_t *data, unsigned size) {
+  unsigned i;
+  for (i = 0; i < size; i++)
+    sprintf(out + i * 2, "%02x", data[i]);
+}
+
+void digest_print(FILE *f, const char *name, const struct image_digest *d) {
+  char buf[41];
+  const char *base = strrchr(name, '/');
+  if (base)
+    name = base + 1;
+  fprintf(f, "<rom name=\"");
+  for (; *name; name++) {
+    switch (*name) {
+    case '&':
+      fputs("&amp;", f);
+      break;
+    case '"':
+      fputs("&quot;", f);
+      break;
+    case '<':
+      fputs("&lt;", f);
+      break;
+    case '>':
+      fputs("&gt;", f);
+      break;
+    default:
+      fputc(*name, f);
+    }
+  }
+  fprintf(f, "\" size=\"%llu\"", (unsigned long long)d->size);
+  if (d->which & HASH_CRC32)
+    fprintf(f, " crc=\"%08x\"", d->crc32);
+  if (d->which & HASH_MD5) {
+    hex(buf, d->md5, 16);
+    fprintf(f, " md5=\"%s\"", buf);
+  }
+  if (d->which & HASH_SHA1) {
+    hex(buf, d->sha1, 20);
+    fprintf(f, " sha1=\"%s\"", buf);
+  }
+  fprintf(f, "/>\n");
+}
+
+/* Copy the value of attribute name of a tag into value */
+static bool dat_attribute(const char *tag, const char *name, char *value,
+                          size_t size) {
+  size_t len = strlen(name);
+  const char *p = tag;
+  while ((p = strstr(p, name))) {
+    if ((p > tag) && ((p[-1] == ' ') || (p[-1] == '\t')) && (p[len] == '=') &&
+        (p[len + 1] == '"')) {
+      const char *end;
+      p += len + 2;
+      end = strchr(p, '"');
+      if (!end || ((size_t)(end - p) >= size))
+        return false;
+      memcpy(value, p, end - p);
+      value[end - p] = 0;
+      return true;
+    }
+    p += len;
+  }
+  return false;
+}
+
+int dat_check(const char *datfile, const struct image_digest *d) {
+  char line[4096];
+  char value[1024];
+  char buf[41];
+  unsigned checked = 0;
+  FILE *f = fopen(datfile, "r");
+  if (!f) {
+    perror(datfile);
+    return 1;
+  }
+  while (fgets(line, sizeof(line), f)) {
+    const char *rom = strstr(line, "<rom ");
+    unsigned matched = 0;
+    if (!rom)
+      continue;
+    if (!dat_attribute(rom, "size", value, sizeof(value)) ||
+        (strtoull(value, NULL, 10) != d->size))
+      continue;
+    if ((d->which & HASH_CRC32) &&
+        dat_attribute(rom, "crc", value, sizeof(value))) {
+      if (strtoul(value, NULL, 16) != d->crc32)
+        continue;
+      matched |= HASH_CRC32;
+    }
+    if ((d->which & HASH_MD5) &&
+        dat_attribute(rom, "md5", value, sizeof(value))) {
+      hex(buf, d->md5, 16);
+      if (strcasecmp(value, buf))
+        continue;
+      matched |= HASH_MD5;
+    }
+    if ((d->which & HASH_SHA1) &&
+        dat_attribute(rom, "sha1", value, sizeof(value))) {
+      hex(buf, d->sha1, 20);
+      if (strcasecmp(value, buf))
+        continue;
+      matched |= HASH_SHA1;
+    }
+    /* A size match alone proves nothing */
+    if (!matched)
+      continue;
+    if (!dat_attribute(rom, "name", value, sizeof(value)))
+      strcpy(value, "?");
+    fprintf(stderr, "DAT match: %s\n", value);
+    checked++;
+  }
+  fclose(f);
+  if (!checked) {
+    fprintf(stderr, "No entry in %s matches\n", datfile);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,200 @@
+/***************************************************************************/
+/*
+** ECM - Encoder for ECM (Error Code Modeler) format.
+** Version 1.0
+** Copyright (C) 2002 Neill Corlett
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+/*
+** Record map of an ECM file, for random access to the original file.
+**
+** Building the map only reads the type/count combos (and frame headers),
+** skipping over the payloads. Any byte range of the original file can then
+** be rebuilt from the few records it overlaps. Nothing is checked against
+** the EDC of the whole file, since that would mean decoding all of it.
+*/
+/***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unecm.h"
+
+static bool index_append(struct ecm_index *index, unsigned type,
+                         uint32_t count, uint64_t inoffset) {
+  struct ecm_record *r;
+  if (index->n == index->allocated) {
+    size_t allocated = index->allocated ? index->allocated * 2 : 256;
+    r = realloc(index->record, allocated * sizeof(*r));
+    if (!r)
+      return false;
+    index->record = r;
+    index->allocated = allocated;
+  }
+  r = &index->record[index->n++];
+  r->outoffset = index->size;
+  r->inoffset = inoffset;
+  r->count = count;
+  r->type = type;
+  index->size += (uint64_t)count * record_output_size(type);
+  return true;
+}
+
+/*
+** Read the records up to end (or up to the end-of-records indicator if end
+** is negative)
+*/
+static bool index_records(FILE *in, struct ecm_index *index, long end) {
+  unsigned type;
+  unsigned num;
+  while ((end < 0) || (ftell(in) < end)) {
+    if (read_type_count(in, &type, &num))
+      return false;
+    if ((end < 0) && (num == 0xFFFFFFFF))
+      return true;
+    num++;
+    if ((num >= 0x80000000) || !num)
+      return false;
+    if (!index_append(index, type, num, ftell(in)))
+      return false;
+    fseek(in, (long)num * ecm_index_payload_size(index, type), SEEK_CUR);
+  }
+  return ftell(in) == end;
+}
+
+bool ecm_index_build(FILE *in, struct ecm_index *index) {
+  unsigned char buf[ECM_FRAME_HEADER_SIZE];
+  int flags;
+  memset(index, 0, sizeof(*index));
+  fseek(in, 0, SEEK_SET);
+  if ((fgetc(in) != 'E') || (fgetc(in) != 'C') || (fgetc(in) != 'M'))
+    return false;
+  flags = fgetc(in);
+  if ((flags == EOF) || (flags & ~(ECM_FLAG_FRAMED | ECM_FLAG_STORE)))
+    return false;
+  index->flags = flags;
+  if (!(flags & ECM_FLAG_FRAMED)) {
+    if (!index_records(in, index, -1) || (fread(buf, 1, 4, in) != 4))
+      goto fail;
+    index->edc = get_le32(buf);
+    return true;
+  }
+  for (;;) {
+    struct ecm_frame frame;
+    if ((fread(buf, 1, sizeof(buf), in) != sizeof(buf)) ||
+        !frame_header_unpack(buf, &frame) ||
+        (frame.outoffset != index->size))
+      goto fail;
+    if (!frame.outbytes && !frame.encbytes) {
+      index->edc = frame.crc;
+      return true;
+    }
+    if (!index_records(in, index, ftell(in) + (long)frame.encbytes) ||
+        (index->size != frame.outoffset + frame.outbytes))
+      goto fail;
+  }
+fail:
+  ecm_index_free(index);
+  return false;
+}
+
+void ecm_index_free(struct ecm_index *index) {
+  free(index->record);
+  memset(index, 0, sizeof(*index));
+}
+
+unsigned ecm_index_payload_size(const struct ecm_index *index,
+                                unsigned type) {
+  if (index->flags & ECM_FLAG_STORE)
+    return record_ref_size(type);
+  return record_payload_size(type);
+}
+
+const struct ecm_record *ecm_index_find(const struct ecm_index *index,
+                                        uint64_t offset) {
+  size_t lo = 0, hi = index->n;
+  if (offset >= index->size)
+    return NULL;
+  /* Last record that starts at or before offset */
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (index->record[mid].outoffset <= offset)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return &index->record[lo];
+}
+
+bool ecm_index_payload(const struct ecm_index *index,
+                       const struct ecm_source *source,
+                       struct sector_store *store, const struct ecm_record *r,
+                       uint32_t k, uint8_t *payload) {
+  unsigned size = ecm_index_payload_size(index, r->type);
+  unsigned head = (r->type == 1) ? 3 : 4;
+  uint8_t ref[4 + STORE_REF_SIZE];
+  const uint8_t *data;
+  uint64_t pos = r->inoffset + (uint64_t)k * size;
+  if (!(index->flags & ECM_FLAG_STORE))
+    return source->read(source->ctx, pos, payload, size);
+  if (!store || !source->read(source->ctx, pos, ref, size))
+    return false;
+  data = store_get(store, ref + head, record_store_size(r->type));
+  if (!data)
+    return false;
+  memcpy(payload, ref, head);
+  memcpy(payload + head, data, record_store_size(r->type));
+  return true;
+}
+
+bool ecm_index_read(const struct ecm_index *index,
+                    const struct ecm_source *source,
+                    struct sector_store *store, uint64_t offset, uint8_t *buf,
+                    size_t size) {
+  uint8_t sector[SECTOR_1_SIZE];
+  uint8_t payload[0x918];
+  while (size) {
+    const struct ecm_record *r = ecm_index_find(index, offset);
+    uint64_t rel;
+    size_t n;
+    if (!r)
+      return false;
+    rel = offset - r->outoffset;
+    if (!r->type) {
+      n = r->count - rel;
+      if (n > size)
+        n = size;
+      if (!source->read(source->ctx, r->inoffset + rel, buf, n))
+        return false;
+    } else {
+      unsigned unit = record_output_size(r->type);
+      unsigned skip = rel % unit;
+      if (!ecm_index_payload(index, source, store, r, rel / unit, payload))
+        return false;
+      sector_rebuild(sector, r->type, payload);
+      n = unit - skip;
+      if (n > size)
+        n = size;
+      /* Type 2 and 3 sectors start after the sync and header */
+      memcpy(buf, sector + skip + (r->type == 1 ? 0 : 0x10), n);
+    }
+    buf += n;
+    offset += n;
+    size -= n;
+  }
+  return true;
+}
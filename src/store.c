@@ -0,0 +1,723 @@
+/***************************************************************************/
+/*
+** ECM - Encoder for ECM (Error Code Modeler) format.
+** Version 1.0
+** Copyright (C) 2002 Neill Corlett
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+/*
+** Shared sector store.
+**
+** Sector data (everything but the address or subheader) can be kept in a
+** store file shared by many ECM files, so that sectors that several discs
+** or revisions have in common are stored once. The ECM file then holds the
+** SHA-1 of the data and the offset of its entry in the store.
+**
+** The store is "ECMS", a version byte, three zero bytes and the committed
+** end (LE64), followed by entries of a 20-byte SHA-1, the data size (LE32)
+** and the data. It is only ever appended to, under an exclusive flock(), so
+** readers can map it without locking: entries never move or change once
+** written. A writer holds the lock from store_open_write() to
+** store_close(), so encodes into the same store run one after the other:
+** a second `ecm --store` waits until the first one has finished.
+**
+** The committed end only moves up once everything before it has been
+** fsynced, and ECM files only refer to entries before it. After a crash,
+** the entries past it may have a proper key and size but data that never
+** made it to the disk, so the next writer checks their SHA-1 and cuts the
+** store off at the first one that is wrong or torn.
+**
+** Writers find entries through <store>.idx, an open-addressing hash table
+** of key and offset kept on disk and mapped, so opening a store does not
+** read all of it. The index only ever holds committed entries: new ones
+** are kept in memory and moved into it after the store is committed. Its
+** header says how much of the store it covers; entries after that are
+** indexed when the store is opened. A missing or stale index is rebuilt
+** from the store.
+*/
+/***************************************************************************/
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unecm.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define STORE_HEADER_SIZE 16
+#define STORE_ENTRY_HEADER_SIZE (STORE_KEY_SIZE + 4)
+#define STORE_VERSION 2
+/* Entries are written out in blocks of this size */
+#define STORE_WRITE_BUFFER 0x100000
+/* New entries kept in memory before the store is committed and indexed */
+#define STORE_NEW_MAX 0x100000
+
+/*
+** Index file: "ECMI", a version byte, three zero bytes, the number of slots
+** (a power of two), the number of used slots and the store offset up to
+** which all entries are in it (all LE64). Slots are a 20-byte key, four
+** zero bytes and the entry offset (LE64, 0 for an empty slot).
+*/
+#define INDEX_HEADER_SIZE 32
+#define INDEX_SLOT_SIZE 32
+#define INDEX_VERSION 1
+#define INDEX_MIN_SLOTS 0x10000
+
+/* Bytes stored per sector of a type in files with ECM_FLAG_STORE */
+unsigned record_ref_size(unsigned type) {
+  switch (type) {
+  case 1:
+    return 3 + STORE_REF_SIZE;
+  case 2:
+  case 3:
+    return 4 + STORE_REF_SIZE;
+  }
+  return 1;
+}
+
+/* Bytes of a sector of a type that go to the store */
+unsigned record_store_size(unsigned type) {
+  return record_payload_size(type) - (type == 1 ? 3 : 4);
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+
+/* Hash table slot; offset 0 marks an empty one */
+struct store_slot {
+  uint8_t key[STORE_KEY_SIZE];
+  uint64_t offset;
+};
+
+struct sector_store {
+  const char *filename;
+  int fd;
+  bool writable;
+  /* Reading: the whole store, mapped */
+  const uint8_t *map;
+  uint64_t mapsize;
+  /* Writing: the index file, mapped */
+  char *idxname;
+  int idxfd;
+  uint8_t *idx;
+  uint64_t idxslots;
+  uint64_t idxused;
+  uint64_t indexed;
+  /* Writing: entries not in the index file yet, and entries not written */
+  struct store_slot *slot;
+  size_t slots;
+  size_t used;
+  uint64_t end;
+  uint64_t committed;
+  uint8_t *pending;
+  size_t pendingsize;
+  bool failed;
+  unsigned added;
+  unsigned shared;
+};
+
+static size_t slot_index(const struct sector_store *store,
+                         const uint8_t *key) {
+  /* The key is a SHA-1, any part of it is as good as a hash */
+  return get_le64(key) & (store->slots - 1);
+}
+
+static struct store_slot *slot_find(struct sector_store *store,
+                                    const uint8_t *key) {
+  size_t i = slot_index(store, key);
+  while (store->slot[i].offset &&
+         memcmp(store->slot[i].key, key, STORE_KEY_SIZE))
+    i = (i + 1) & (store->slots - 1);
+  return &store->slot[i];
+}
+
+static bool slot_grow(struct sector_store *store) {
+  struct store_slot *old = store->slot;
+  size_t oldslots = store->slots, i;
+  store->slots = oldslots ? oldslots * 2 : 0x10000;
+  store->slot = calloc(store->slots, sizeof(*store->slot));
+  if (!store->slot) {
+    store->slot = old;
+    store->slots = oldslots;
+    return false;
+  }
+  for (i = 0; i < oldslots; i++)
+    if (old[i].offset)
+      *slot_find(store, old[i].key) = old[i];
+  free(old);
+  return true;
+}
+
+static bool slot_add(struct sector_store *store, const uint8_t *key,
+                     uint64_t offset) {
+  struct store_slot *slot;
+  if ((store->used + 1) * 2 > store->slots)
+    if (!slot_grow(store))
+      return false;
+  slot = slot_find(store, key);
+  memcpy(slot->key, key, STORE_KEY_SIZE);
+  slot->offset = offset;
+  store->used++;
+  return true;
+}
+
+static uint64_t index_size(uint64_t slots) {
+  return INDEX_HEADER_SIZE + slots * INDEX_SLOT_SIZE;
+}
+
+/* Slot of a key in an index file map, or the empty one it would go in */
+static uint8_t *index_slot(uint8_t *map, uint64_t slots, const uint8_t *key) {
+  uint64_t i = get_le64(key) & (slots - 1);
+  for (;;) {
+    uint8_t *slot = map + INDEX_HEADER_SIZE + i * INDEX_SLOT_SIZE;
+    if (!get_le64(slot + 24) || !memcmp(slot, key, STORE_KEY_SIZE))
+      return slot;
+    i = (i + 1) & (slots - 1);
+  }
+}
+
+static void index_put(uint8_t *map, uint64_t slots, const uint8_t *key,
+                      uint64_t offset) {
+  uint8_t *slot = index_slot(map, slots, key);
+  memcpy(slot, key, STORE_KEY_SIZE);
+  put_le64(slot + 24, offset);
+}
+
+static void index_header(struct sector_store *store) {
+  memset(store->idx, 0, INDEX_HEADER_SIZE);
+  memcpy(store->idx, "ECMI", 4);
+  store->idx[4] = INDEX_VERSION;
+  put_le64(store->idx + 8, store->idxslots);
+  put_le64(store->idx + 16, store->idxused);
+  put_le64(store->idx + 24, store->indexed);
+}
+
+/*
+** Write a new index file with the given number of slots, holding the
+** entries of the current one (if any), and put it in place of that
+*/
+static bool index_build(struct sector_store *store, uint64_t slots) {
+  char *tmpname = malloc(strlen(store->idxname) + 5);
+  uint64_t size = index_size(slots);
+  uint8_t *map = MAP_FAILED;
+  uint64_t i;
+  int fd;
+  if (!tmpname) {
+    fprintf(stderr, "Out of memory\n");
+    return false;
+  }
+  sprintf(tmpname, "%s.tmp", store->idxname);
+  fd = open(tmpname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if ((fd < 0) || ftruncate(fd, size))
+    goto fail;
+  map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    goto fail;
+  for (i = 0; i < store->idxslots; i++) {
+    const uint8_t *slot = store->idx + INDEX_HEADER_SIZE + i * INDEX_SLOT_SIZE;
+    if (get_le64(slot + 24))
+      index_put(map, slots, slot, get_le64(slot + 24));
+  }
+  /* The slots must be on disk before the file and its header can be seen */
+  if (msync(map, size, MS_SYNC) || rename(tmpname, store->idxname))
+    goto fail;
+  if (store->idx) {
+    munmap(store->idx, index_size(store->idxslots));
+    close(store->idxfd);
+  }
+  store->idx = map;
+  store->idxfd = fd;
+  store->idxslots = slots;
+  index_header(store);
+  free(tmpname);
+  return true;
+fail:
+  perror(tmpname);
+  if (map != MAP_FAILED)
+    munmap(map, size);
+  if (fd >= 0) {
+    close(fd);
+    remove(tmpname);
+  }
+  free(tmpname);
+  return false;
+}
+
+/*
+** Map the index file of a store whose size is given, or start a new one if
+** there is none or it does not fit the store
+*/
+static bool index_open(struct sector_store *store, uint64_t size) {
+  struct stat st;
+  uint64_t slots;
+  store->idxname = malloc(strlen(store->filename) + 5);
+  if (!store->idxname) {
+    fprintf(stderr, "Out of memory\n");
+    return false;
+  }
+  sprintf(store->idxname, "%s.idx", store->filename);
+  store->idxfd = open(store->idxname, O_RDWR);
+  if ((store->idxfd >= 0) && !fstat(store->idxfd, &st) &&
+      (st.st_size >= INDEX_HEADER_SIZE)) {
+    uint8_t *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        store->idxfd, 0);
+    if (map != MAP_FAILED) {
+      slots = get_le64(map + 8);
+      store->idxused = get_le64(map + 16);
+      store->indexed = get_le64(map + 24);
+      /* An index of an empty store might be left over from another one */
+      if (!memcmp(map, "ECMI", 4) && (map[4] == INDEX_VERSION) &&
+          (slots >= INDEX_MIN_SLOTS) && !(slots & (slots - 1)) &&
+          ((uint64_t)st.st_size == index_size(slots)) &&
+          (store->idxused <= slots / 2) &&
+          (store->indexed >= STORE_HEADER_SIZE) &&
+          (store->indexed <= store->committed) &&
+          (store->committed > STORE_HEADER_SIZE)) {
+        store->idx = map;
+        store->idxslots = slots;
+        return true;
+      }
+      munmap(map, st.st_size);
+    }
+  }
+  if (store->idxfd >= 0)
+    close(store->idxfd);
+  store->idxfd = -1;
+  store->idxused = 0;
+  store->indexed = STORE_HEADER_SIZE;
+  /* Entries are over 2 KiB, so this is room for all of them at half load */
+  slots = INDEX_MIN_SLOTS;
+  while (slots < size / 1024)
+    slots *= 2;
+  return index_build(store, slots);
+}
+
+/* Offset of the entry with a key, 0 if there is none */
+static uint64_t store_find(struct sector_store *store, const uint8_t *key) {
+  uint64_t offset = get_le64(index_slot(store->idx, store->idxslots, key) + 24);
+  return offset ? offset : slot_find(store, key)->offset;
+}
+
+/* Add a committed entry to the index file */
+static bool index_add(struct sector_store *store, const uint8_t *key,
+                      uint64_t offset) {
+  if (((store->idxused + 1) * 2 > store->idxslots) &&
+      !index_build(store, store->idxslots * 2))
+    return false;
+  index_put(store->idx, store->idxslots, key, offset);
+  store->idxused++;
+  return true;
+}
+
+/*
+** Move the entries kept in memory into the index file; the store must be
+** committed. The slots are synced before the header that counts them is
+** written (stores to a shared map reach the disk in no particular order),
+** so after a crash the index may hold entries past what it says it covers
+** (which are then added again) but never misses one it claims to have.
+*/
+static bool index_update(struct sector_store *store) {
+  uint64_t slots = store->idxslots;
+  size_t i;
+  while ((store->idxused + store->used) * 2 > slots)
+    slots *= 2;
+  if ((slots != store->idxslots) && !index_build(store, slots))
+    return false;
+  for (i = 0; i < store->slots; i++)
+    if (store->slot[i].offset)
+      index_put(store->idx, store->idxslots, store->slot[i].key,
+                store->slot[i].offset);
+  if (msync(store->idx, index_size(store->idxslots), MS_SYNC)) {
+    perror(store->idxname);
+    return false;
+  }
+  store->idxused += store->used;
+  store->indexed = store->committed;
+  index_header(store);
+  memset(store->slot, 0, store->slots * sizeof(*store->slot));
+  store->used = 0;
+  return true;
+}
+
+static bool store_header_ok(const uint8_t *header) {
+  return !memcmp(header, "ECMS", 4) && (header[4] == STORE_VERSION);
+}
+
+static struct sector_store *store_new(const char *filename, bool writable) {
+  struct sector_store *store = calloc(1, sizeof(*store));
+  if (!store) {
+    fprintf(stderr, "Out of memory\n");
+    return NULL;
+  }
+  store->filename = filename;
+  store->writable = writable;
+  store->idxfd = -1;
+  store->fd = open(filename, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+  if (store->fd < 0) {
+    perror(filename);
+    free(store);
+    return NULL;
+  }
+  return store;
+}
+
+static void store_free(struct sector_store *store) {
+  if (store->map)
+    munmap((void *)store->map, store->mapsize);
+  close(store->fd);
+  if (store->idx)
+    munmap(store->idx, index_size(store->idxslots));
+  if (store->idxfd >= 0)
+    close(store->idxfd);
+  free(store->idxname);
+  free(store->slot);
+  free(store->pending);
+  free(store);
+}
+
+static bool store_flush(struct sector_store *store) {
+  const uint8_t *p = store->pending;
+  uint64_t pos = store->end - store->pendingsize;
+  while (store->pendingsize) {
+    ssize_t n = pwrite(store->fd, p, store->pendingsize, pos);
+    if (n <= 0) {
+      perror(store->filename);
+      store->failed = true;
+      return false;
+    }
+    p += n;
+    pos += n;
+    store->pendingsize -= n;
+  }
+  return true;
+}
+
+/*
+** Index the entries of an existing store that the index file does not
+** cover yet. Entries past the committed end are only taken if their data
+** matches their SHA-1, and are kept in memory until they are committed.
+** Stops at the first entry that is not complete or does not match; the
+** caller cuts the file off there.
+*/
+static bool store_index(struct sector_store *store, const uint8_t *map,
+                        uint64_t size) {
+  uint64_t pos = store->indexed;
+  uint8_t key[STORE_KEY_SIZE];
+  while (size - pos >= STORE_ENTRY_HEADER_SIZE) {
+    uint32_t len = get_le32(map + pos + STORE_KEY_SIZE);
+    if (len > size - pos - STORE_ENTRY_HEADER_SIZE)
+      break;
+    if (pos < store->committed) {
+      if (!index_add(store, map + pos, pos))
+        return false;
+    } else {
+      sha1_compute(map + pos + STORE_ENTRY_HEADER_SIZE, len, key);
+      if (memcmp(key, map + pos, STORE_KEY_SIZE))
+        break;
+      if (!slot_add(store, map + pos, pos)) {
+        fprintf(stderr, "Out of memory\n");
+        return false;
+      }
+    }
+    pos += STORE_ENTRY_HEADER_SIZE + len;
+  }
+  store->end = pos;
+  return true;
+}
+
+/*
+** Get everything written so far onto the disk, then move the committed
+** end up to it
+*/
+static bool store_commit(struct sector_store *store) {
+  uint8_t end[8];
+  if (!store_flush(store) || store->failed)
+    return false;
+  if (store->committed == store->end)
+    return true;
+  put_le64(end, store->end);
+  if (fsync(store->fd) || (pwrite(store->fd, end, 8, 8) != 8) ||
+      fsync(store->fd)) {
+    perror(store->filename);
+    store->failed = true;
+    return false;
+  }
+  store->committed = store->end;
+  return true;
+}
+
+/* Commit the store, then index what was added */
+static bool store_checkpoint(struct sector_store *store) {
+  if (!store_commit(store))
+    return false;
+  if (!index_update(store)) {
+    store->failed = true;
+    return false;
+  }
+  return true;
+}
+
+struct sector_store *store_open_write(const char *filename) {
+  struct sector_store *store = store_new(filename, true);
+  struct stat st;
+  uint8_t header[STORE_HEADER_SIZE];
+  if (!store)
+    return NULL;
+  /* One writer at a time, for as long as it has the store open */
+  if (flock(store->fd, LOCK_EX) || fstat(store->fd, &st)) {
+    perror(filename);
+    goto fail;
+  }
+  store->pending = malloc(STORE_WRITE_BUFFER);
+  if (!store->pending || !slot_grow(store)) {
+    fprintf(stderr, "Out of memory\n");
+    goto fail;
+  }
+  if (!st.st_size) {
+    memset(header, 0, sizeof(header));
+    memcpy(header, "ECMS", 4);
+    header[4] = STORE_VERSION;
+    put_le64(header + 8, STORE_HEADER_SIZE);
+    if (pwrite(store->fd, header, sizeof(header), 0) != sizeof(header)) {
+      perror(filename);
+      goto fail;
+    }
+    store->end = STORE_HEADER_SIZE;
+    store->committed = STORE_HEADER_SIZE;
+    if (!index_open(store, 0))
+      goto fail;
+  } else if (st.st_size < STORE_HEADER_SIZE) {
+    fprintf(stderr, "%s: not a sector store\n", filename);
+    goto fail;
+  } else {
+    const uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+                              store->fd, 0);
+    bool ok;
+    if (map == MAP_FAILED) {
+      perror(filename);
+      goto fail;
+    }
+    if (!store_header_ok(map)) {
+      fprintf(stderr, "%s: not a sector store\n", filename);
+      munmap((void *)map, st.st_size);
+      goto fail;
+    }
+    store->committed = get_le64(map + 8);
+    if (store->committed > (uint64_t)st.st_size)
+      store->committed = st.st_size;
+    ok = index_open(store, st.st_size) && store_index(store, map, st.st_size);
+    munmap((void *)map, st.st_size);
+    if (!ok)
+      goto fail;
+    if ((uint64_t)st.st_size != store->end) {
+      fprintf(stderr, "%s: dropping %llu bytes of unfinished entries\n",
+              filename, (unsigned long long)(st.st_size - store->end));
+      if (ftruncate(store->fd, store->end)) {
+        perror(filename);
+        goto fail;
+      }
+    }
+    /* Entries that were checked are committed, the cut ones are not */
+    if (!store_checkpoint(store))
+      goto fail;
+  }
+  return store;
+fail:
+  store_free(store);
+  return NULL;
+}
+
+struct sector_store *store_open_read(const char *filename) {
+  struct sector_store *store = store_new(filename, false);
+  struct stat st;
+  void *map;
+  if (!store)
+    return NULL;
+  if (fstat(store->fd, &st)) {
+    perror(filename);
+    goto fail;
+  }
+  if (st.st_size < STORE_HEADER_SIZE) {
+    fprintf(stderr, "%s: not a sector store\n", filename);
+    goto fail;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, store->fd, 0);
+  if (map == MAP_FAILED) {
+    perror(filename);
+    goto fail;
+  }
+  store->map = map;
+  store->mapsize = st.st_size;
+  if (!store_header_ok(store->map)) {
+    fprintf(stderr, "%s: not a sector store\n", filename);
+    goto fail;
+  }
+  return store;
+fail:
+  store_free(store);
+  return NULL;
+}
+
+bool store_put(struct sector_store *store, const uint8_t *data, uint32_t size,
+               uint8_t *ref) {
+  uint64_t offset;
+  uint8_t *entry;
+  if (store->failed)
+    return false;
+  sha1_compute(data, size, ref);
+  offset = store_find(store, ref);
+  if (offset) {
+    put_le64(ref + STORE_KEY_SIZE, offset);
+    store->shared++;
+    return true;
+  }
+  if (STORE_ENTRY_HEADER_SIZE + (size_t)size > STORE_WRITE_BUFFER) {
+    fprintf(stderr, "%s: entry too large\n", store->filename);
+    store->failed = true;
+    return false;
+  }
+  if (STORE_WRITE_BUFFER - store->pendingsize <
+      STORE_ENTRY_HEADER_SIZE + (size_t)size)
+    if (!store_flush(store))
+      return false;
+  if (!slot_add(store, ref, store->end)) {
+    fprintf(stderr, "Out of memory\n");
+    store->failed = true;
+    return false;
+  }
+  entry = store->pending + store->pendingsize;
+  memcpy(entry, ref, STORE_KEY_SIZE);
+  put_le32(entry + STORE_KEY_SIZE, size);
+  memcpy(entry + STORE_ENTRY_HEADER_SIZE, data, size);
+  put_le64(ref + STORE_KEY_SIZE, store->end);
+  store->pendingsize += STORE_ENTRY_HEADER_SIZE + size;
+  store->end += STORE_ENTRY_HEADER_SIZE + size;
+  store->added++;
+  /* Keep the entries held in memory few, whatever the caller does */
+  if (store->used >= STORE_NEW_MAX)
+    return store_checkpoint(store);
+  return true;
+}
+
+const uint8_t *store_get(struct sector_store *store, const uint8_t *ref,
+                         uint32_t size) {
+  uint64_t offset = get_le64(ref + STORE_KEY_SIZE);
+  const uint8_t *entry;
+  uint8_t key[STORE_KEY_SIZE];
+  if ((offset < STORE_HEADER_SIZE) || (offset > store->mapsize) ||
+      (store->mapsize - offset < STORE_ENTRY_HEADER_SIZE + (uint64_t)size))
+    return NULL;
+  entry = store->map + offset;
+  if (memcmp(entry, ref, STORE_KEY_SIZE) ||
+      (get_le32(entry + STORE_KEY_SIZE) != size))
+    return NULL;
+  /*
+  ** Check the data itself too: the EDC of a whole ECM file does not notice
+  ** damage to mode 2 form 2 sector data, and a store is shared by many files
+  */
+  sha1_compute(entry + STORE_ENTRY_HEADER_SIZE, size, key);
+  if (memcmp(key, ref, STORE_KEY_SIZE))
+    return NULL;
+  return entry + STORE_ENTRY_HEADER_SIZE;
+}
+
+bool store_sync(struct sector_store *store) {
+  return store_checkpoint(store);
+}
+
+const char *store_name(const struct sector_store *store) {
+  return store->filename;
+}
+
+uint64_t store_size(const struct sector_store *store) {
+  return store->writable ? store->end : store->mapsize;
+}
+
+bool store_close(struct sector_store *store) {
+  bool ok = true;
+  if (store->writable) {
+    /* Entries must be on disk before any ECM file refers to them */
+    ok = store_checkpoint(store);
+    if (ok)
+      fprintf(stderr, "Store: %u sectors added, %u shared\n", store->added,
+              store->shared);
+    else
+      fprintf(stderr, "%s: could not write to the store\n", store->filename);
+  }
+  store_free(store);
+  return ok;
+}
+
+#else
+
+struct sector_store *store_open_write(const char *filename) {
+  fprintf(stderr, "%s: sector stores are not supported on this platform\n",
+          filename);
+  return NULL;
+}
+
+struct sector_store *store_open_read(const char *filename) {
+  return store_open_write(filename);
+}
+
+bool store_put(struct sector_store *store, const uint8_t *data, uint32_t size,
+               uint8_t *ref) {
+  (void)store;
+  (void)data;
+  (void)size;
+  (void)ref;
+  return false;
+}
+
+const uint8_t *store_get(struct sector_store *store, const uint8_t *ref,
+                         uint32_t size) {
+  (void)store;
+  (void)ref;
+  (void)size;
+  return NULL;
+}
+
+bool store_sync(struct sector_store *store) {
+  (void)store;
+  return false;
+}
+
+const char *store_name(const struct sector_store *store) {
+  (void)store;
+  return "";
+}
+
+uint64_t store_size(const struct sector_store *store) {
+  (void)store;
+  return 0;
+}
+
+bool store_close(struct sector_store *store) {
+  (void)store;
+  return false;
+}
+
+#endif
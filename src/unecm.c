@@ -34,140 +34,522 @@
 #include <string.h>
 #include "unecm.h"
 
+/***************************************************************************/
+
+/* Sectors decoded per batch */
+#define DECODE_BATCH 2048
+/* Bytes of the ECM file read at a time */
+#define DECODE_READAHEAD 0x100000
+
+/* Payloads of a batch as read from the ECM file */
+static uint8_t decode_inbuf[DECODE_BATCH * 0x918];
+/*
+** Decoded output waiting to be written, back to back as it goes out. It is
+** filled across runs and only written when it is full, before the output
+** file is seeked or copied to directly, at checkpoints and at the end. The
+** first 16 bytes are room for the sync and header of a mode 2 sector at the
+** start, which are needed while generating its ECC but not written.
+*/
+static uint8_t decode_outbuf[0x10 + DECODE_BATCH * SECTOR_1_SIZE];
+static size_t decode_outlen;
+
+/* Store the sector data of ECM_FLAG_STORE files is looked up in */
+static struct sector_store *decode_store;
+/* Set if sector records of this file hold store references */
+static bool decode_refs;
+/* References of a batch as read from the ECM file */
+static uint8_t decode_refbuf[DECODE_BATCH * (4 + STORE_REF_SIZE)];
+
+/* Bytes in the ECM file per sector (or literal byte) of a type */
+static unsigned payload_size(unsigned type) {
+  return decode_refs ? record_ref_size(type) : record_payload_size(type);
+}
+
+/*
+** Read the payloads of n sectors of a type into decode_inbuf, looking up
+** the sector data in the store if the file holds references
+** Returns 0 on success, 1 on EOF or if the store lacks a sector
+*/
+static int read_payloads(FILE *in, unsigned type, unsigned n) {
+  unsigned payload = record_payload_size(type);
+  unsigned head = (type == 1) ? 3 : 4;
+  unsigned size = record_store_size(type);
+  unsigned ref = record_ref_size(type);
+  unsigned i;
+  if (!decode_refs)
+    return fread(decode_inbuf, payload, n, in) != n;
+  if (fread(decode_refbuf, ref, n, in) != n)
+    return 1;
+  for (i = 0; i < n; i++) {
+    const uint8_t *src = decode_refbuf + i * ref;
+    uint8_t *dst = decode_inbuf + i * payload;
+    const uint8_t *data = store_get(decode_store, src + head, size);
+    if (!data) {
+      fprintf(stderr, "Sector data not found in the store\n");
+      return 1;
+    }
+    memcpy(dst, src, head);
+    memcpy(dst + head, data, size);
+  }
+  return 0;
+}
+
+/* Free room at the end of decode_outbuf */
+static size_t decode_room(void) {
+  return sizeof(decode_outbuf) - 0x10 - decode_outlen;
+}
+
+/* Pass size bytes just decoded at the end of decode_outbuf on to all checks */
+static void decode_emit(size_t size, unsigned *edc, uint32_t *crc) {
+  const uint8_t *data = decode_outbuf + 0x10 + decode_outlen;
+  size_t done;
+  for (done = 0; done < size; done += 0x8000) {
+    size_t b = size - done < 0x8000 ? size - done : 0x8000;
+    *edc = edc_partial_computeblock(*edc, data + done, b);
+  }
+  if (crc)
+    *crc = crc32_computeblock(*crc, data, size);
+  image_hash(data, size);
+  decode_outlen += size;
+}
+
+/* Write out the decoded output collected so far */
+static void decode_flush(FILE *out) {
+  if (out && decode_outlen)
+    fwrite(decode_outbuf + 0x10, 1, decode_outlen, out);
+  decode_outlen = 0;
+}
 
 /***************************************************************************/
+/*
+** Cooked (--iso) output: only the 2048 bytes of user data of each sector
+** are written, taken straight from the ECM payload without rebuilding the
+** sector. Mode 2 form 2 sectors, audio and anything else without 2048-byte
+** user data become 2048 zero bytes (ISO_ZERO, keeps every sector at its
+** LBA) or are left out (ISO_SKIP). Literal bytes are looked at as raw
+** 2352-byte sectors of the image; partial ones, like the headers in front
+** of mode 2 records, are dropped.
+*/
+#define ISO_OFF 0
+#define ISO_ZERO 1
+#define ISO_SKIP 2
+
+static int iso_mode = ISO_OFF;
+/* Position in the original image */
+static uint64_t iso_pos;
+/* Literal bytes of the raw sector at iso_pos collected so far */
+static uint8_t iso_sector[SECTOR_1_SIZE];
+static unsigned iso_have;
+/* User data bytes written */
+static uint64_t iso_written;
+
+static void iso_emit(FILE *out, const uint8_t *data, size_t size) {
+  if (out)
+    fwrite(data, 1, size, out);
+  image_hash(data, size);
+  iso_written += size;
+}
 
-void edc_computeblock(const uint8_t *src, uint16_t size, uint8_t *dest) {
-  uint32_t edc = edc_partial_computeblock(0, src, size);
-  dest[0] = (edc >> 0) & 0xFF;
-  dest[1] = (edc >> 8) & 0xFF;
-  dest[2] = (edc >> 16) & 0xFF;
-  dest[3] = (edc >> 24) & 0xFF;
+static void iso_nodata(FILE *out) {
+  static const uint8_t zero[0x800];
+  if (iso_mode == ISO_ZERO)
+    iso_emit(out, zero, sizeof(zero));
+}
+
+/* A raw sector found among literal bytes */
+static void iso_cook(FILE *out, const uint8_t *sector) {
+  static const uint8_t sync[12] = {0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+                                   0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00};
+  if (!memcmp(sector, sync, sizeof(sync))) {
+    if (sector[0x0F] == 0x01) {
+      iso_emit(out, sector + 0x10, 0x800);
+      return;
+    }
+    /* Form 2 is bit 5 of the submode byte */
+    if ((sector[0x0F] == 0x02) && !(sector[0x12] & 0x20)) {
+      iso_emit(out, sector + 0x18, 0x800);
+      return;
+    }
+  }
+  iso_nodata(out);
+}
+
+int iso_run(FILE *in, FILE *out, unsigned type, unsigned num) {
+  unsigned payload = record_payload_size(type);
+  if (!type) {
+    while (num) {
+      unsigned b = num, i = 0;
+      if (b > sizeof(decode_outbuf))
+        b = sizeof(decode_outbuf);
+      if (fread(decode_outbuf, 1, b, in) != b)
+        return 1;
+      while (i < b) {
+        unsigned rel = iso_pos % SECTOR_1_SIZE;
+        unsigned n = SECTOR_1_SIZE - rel;
+        if (n > b - i)
+          n = b - i;
+        /* Only collect sectors that are literal from their first byte */
+        if (rel == iso_have) {
+          memcpy(iso_sector + rel, decode_outbuf + i, n);
+          iso_have += n;
+          if (iso_have == SECTOR_1_SIZE)
+            iso_cook(out, iso_sector);
+        }
+        iso_pos += n;
+        i += n;
+        if (!(iso_pos % SECTOR_1_SIZE))
+          iso_have = 0;
+      }
+      num -= b;
+      setcounter_decode(ftell(in));
+    }
+    return 0;
+  }
+  iso_pos += (uint64_t)num * record_output_size(type);
+  iso_have = 0;
+  while (num) {
+    unsigned n = num < DECODE_BATCH ? num : DECODE_BATCH;
+    unsigned i, k = 0;
+    if (read_payloads(in, type, n))
+      return 1;
+    for (i = 0; i < n; i++) {
+      const uint8_t *src = decode_inbuf + i * payload;
+      uint8_t *dst = decode_outbuf + k * 0x800;
+      switch (type) {
+      case 1:
+        memcpy(dst, src + 3, 0x800);
+        k++;
+        break;
+      case 2:
+        memcpy(dst, src + 4, 0x800);
+        k++;
+        break;
+      case 3:
+        if (iso_mode == ISO_ZERO) {
+          memset(dst, 0, 0x800);
+          k++;
+        }
+        break;
+      }
+    }
+    iso_emit(out, decode_outbuf, (size_t)k * 0x800);
+    num -= n;
+    setcounter_decode(ftell(in));
+  }
+  return 0;
 }
 
 /***************************************************************************/
+
 /*
-** Generate ECC/EDC information for a sector (must be 2352 = 0x930 bytes)
-** Returns 0 on success
+** Decode a run of num sectors/literals of the same type
+** Sectors are decoded in batches: one read for all payloads of a batch,
+** decoded straight into decode_outbuf behind the output of earlier runs.
+** Nothing is written if out is NULL.
+** In --iso mode this hands over to iso_run() and leaves edc/crc alone.
+** The CRC of the output is kept in crc as well, if it is not NULL
+** Returns 0 on success, 1 on EOF
 */
-void eccedc_generate(uint8_t *sector, int type) {
-  uint32_t i;
-  switch (type) {
-  case 1: /* Mode 1 */
-    /* Compute EDC */
-    edc_computeblock(sector + 0x00, 0x810, sector + 0x810);
-    /* Write out zero bytes */
-    for (i = 0; i < 8; i++)
-      sector[0x814 + i] = 0;
-    /* Generate ECC P/Q codes */
-    ecc_generate_decode(sector, false);
-    break;
-  case 2: /* Mode 2 form 1 */
-    /* Compute EDC */
-    edc_computeblock(sector + 0x10, 0x808, sector + 0x818);
-    /* Generate ECC P/Q codes */
-    ecc_generate_decode(sector, true);
-    break;
-  case 3: /* Mode 2 form 2 */
-    /* Compute EDC */
-    edc_computeblock(sector + 0x10, 0x91C, sector + 0x92C);
-    break;
+int decode_run(FILE *in, FILE *out, unsigned type, unsigned num,
+               unsigned *edc, uint32_t *crc) {
+  unsigned payload = record_payload_size(type);
+  unsigned size = record_output_size(type);
+  unsigned i;
+  if (iso_mode)
+    return iso_run(in, out, type, num);
+  if (!type) {
+    if (num >= LITERAL_PASSTHROUGH_MIN)
+      decode_flush(out);
+    if (literal_passthrough(in, out, num, edc, crc)) {
+      setcounter_decode(ftell(in));
+      return 0;
+    }
+    while (num) {
+      size_t b = decode_room();
+      if (!b) {
+        decode_flush(out);
+        continue;
+      }
+      if (b > num)
+        b = num;
+      if (fread(decode_outbuf + 0x10 + decode_outlen, 1, b, in) != b)
+        return 1;
+      decode_emit(b, edc, crc);
+      num -= b;
+      setcounter_decode(ftell(in));
+    }
+    return 0;
   }
+  while (num) {
+    unsigned n = decode_room() / size;
+    uint8_t *outbuf = decode_outbuf + 0x10 + decode_outlen;
+    if (!n) {
+      decode_flush(out);
+      continue;
+    }
+    if (n > DECODE_BATCH)
+      n = DECODE_BATCH;
+    if (n > num)
+      n = num;
+    if (read_payloads(in, type, n))
+      return 1;
+    for (i = 0; i < n; i++) {
+      const uint8_t *src = decode_inbuf + i * payload;
+      uint8_t *sector;
+      if (type == 1) {
+        sector = outbuf + i * SECTOR_1_SIZE;
+        sector[0x00] = 0x00;
+        memset(sector + 0x01, 0xFF, 10);
+        sector[0x0B] = 0x00;
+        sector[0x0F] = 0x01;
+        memcpy(sector + 0x00C, src, 0x003);
+        memcpy(sector + 0x010, src + 0x003, 0x800);
+      } else {
+        /*
+        ** Only the part from the subheader on is written out; the 16 bytes
+        ** in front are borrowed from the output before it
+        */
+        sector = outbuf + i * SECTOR_2_SIZE - 0x10;
+        memcpy(sector + 0x014, src, payload);
+        memcpy(sector + 0x010, src, 4);
+      }
+      eccedc_generate(sector, type);
+    }
+    decode_emit((size_t)n * size, edc, crc);
+    num -= n;
+    setcounter_decode(ftell(in));
+  }
+  return 0;
+}
+
+/*
+** Checkpoints: the output file they are kept for (NULL if none), the one
+** to resume from, and the output offset of the last one
+*/
+static const char *ckpt_output;
+static struct checkpoint *ckpt_resume;
+static uint64_t ckpt_last;
+
+/*
+** Save a checkpoint at the current record boundary if it is time to.
+** produced is the number of output bytes that are done.
+*/
+static void decode_checkpoint(FILE *in, FILE *out, unsigned flags,
+                              uint64_t produced, unsigned checkedc,
+                              unsigned badframes) {
+  struct checkpoint c;
+  long pos = ftell(in);
+  if (!ckpt_output || (produced - ckpt_last < CHECKPOINT_INTERVAL))
+    return;
+  memset(&c, 0, sizeof(c));
+  fseek(in, 0, SEEK_END);
+  c.insize = ftell(in);
+  fseek(in, pos, SEEK_SET);
+  c.in = pos;
+  c.out = produced;
+  c.edc = checkedc;
+  c.flags = flags;
+  c.frameheader = -1;
+  c.runtype = -1;
+  c.bad = badframes;
+  decode_flush(out);
+  if (checkpoint_identify(&c, in, decode_store) && file_sync(out))
+    checkpoint_save(ckpt_output, &c);
+  ckpt_last = produced;
+}
+
+/*
+** Find the next valid frame header at or after the current position
+** Returns 0 on success, 1 on EOF
+*/
+int find_frame(FILE *in, struct ecm_frame *frame) {
+  unsigned char header[ECM_FRAME_HEADER_SIZE];
+  long pos = ftell(in);
+  size_t have = fread(header, 1, sizeof(header), in);
+  for (;;) {
+    if (have < sizeof(header))
+      return 1;
+    if (frame_header_unpack(header, frame)) {
+      fseek(in, pos + sizeof(header), SEEK_SET);
+      return 0;
+    }
+    memmove(header, header + 1, sizeof(header) - 1);
+    have--;
+    have += fread(header + have, 1, 1, in);
+    pos++;
+  }
+}
+
+/*
+** Decode the frames of a framed ECM file. Each frame is checked on its own;
+** a bad frame is reported and skipped so that the rest can still be
+** recovered.
+*/
+int unecmify_frames(FILE *in, FILE *out) {
+  struct ecm_frame frame;
+  uint64_t expected = 0;
+  uint64_t produced;
+  unsigned badframes = 0;
+  unsigned checkedc = 0;
+  unsigned flags = ECM_FLAG_FRAMED | (decode_refs ? ECM_FLAG_STORE : 0);
+  unsigned type;
+  unsigned num;
+  if (ckpt_resume) {
+    expected = ckpt_resume->out;
+    badframes = ckpt_resume->bad;
+    checkedc = ckpt_resume->edc;
+  }
+  for (;;) {
+    unsigned char header[ECM_FRAME_HEADER_SIZE];
+    uint32_t crc = 0;
+    long start = ftell(in);
+    long end;
+    decode_checkpoint(in, out, flags, expected, checkedc, badframes);
+    if (fread(header, 1, sizeof(header), in) != sizeof(header))
+      goto uneof;
+    if (!frame_header_unpack(header, &frame)) {
+      fprintf(stderr, "Bad frame header at %ld, resyncing\n", start);
+      fseek(in, start + 1, SEEK_SET);
+      if (find_frame(in, &frame))
+        goto uneof;
+      badframes++;
+    }
+    if (!frame.outbytes && !frame.encbytes)
+      break;
+    if (frame.outoffset != expected) {
+      fprintf(stderr, "Missing output bytes %llu-%llu\n",
+              (unsigned long long)expected,
+              (unsigned long long)frame.outoffset - 1);
+      if (out && !iso_mode) {
+        decode_flush(out);
+        fseek(out, frame.outoffset, SEEK_SET);
+      }
+      badframes++;
+    }
+    expected = frame.outoffset + frame.outbytes;
+    end = ftell(in) + frame.encbytes;
+    produced = 0;
+    while (ftell(in) < end) {
+      if (read_type_count(in, &type, &num))
+        goto uneof;
+      num++;
+      if ((num >= 0x80000000) || (num == 0))
+        break;
+      /* Never let a damaged count run into the next frame */
+      if ((uint64_t)num * payload_size(type) >
+          (uint64_t)(end - ftell(in)))
+        break;
+      if (decode_run(in, out, type, num, &checkedc, &crc))
+        goto uneof;
+      produced += (uint64_t)num * record_output_size(type);
+    }
+    if ((ftell(in) != end) ||
+        (produced != frame.outbytes) ||
+        (!iso_mode && (crc != frame.crc))) {
+      fprintf(stderr, "Frame at output bytes %llu-%llu is corrupt\n",
+              (unsigned long long)frame.outoffset,
+              (unsigned long long)expected - 1);
+      fseek(in, end, SEEK_SET);
+      if (out && !iso_mode) {
+        decode_flush(out);
+        fseek(out, expected, SEEK_SET);
+      }
+      badframes++;
+    }
+  }
+  if (frame.outoffset != expected) {
+    fprintf(stderr, "Missing output bytes %llu-%llu\n",
+            (unsigned long long)expected,
+            (unsigned long long)frame.outoffset - 1);
+    badframes++;
+  }
+  fprintf(stderr, "Decoded %ld bytes -> %llu bytes\n", ftell(in),
+          (unsigned long long)frame.outoffset);
+  if (badframes) {
+    fprintf(stderr, "%u bad frames\n", badframes);
+    goto corrupt;
+  }
+  if (iso_mode) {
+    fprintf(stderr, "Extracted %llu bytes of user data; EDC not checked\n",
+            (unsigned long long)iso_written);
+    return 0;
+  }
+  if (checkedc != frame.crc) {
+    fprintf(stderr, "EDC error (%08X, should be %08X)\n", checkedc, frame.crc);
+    goto corrupt;
+  }
+  fprintf(stderr, "Done; file is OK\n");
+  return 0;
+uneof:
+  fprintf(stderr, "Unexpected EOF!\n");
+corrupt:
+  fprintf(stderr, "Corrupt ECM file!\n");
+  return 1;
 }
 
 int unecmify(FILE *in, FILE *out) {
+  uint64_t produced = 0;
   unsigned checkedc = 0;
-  unsigned char sector[SECTOR_1_SIZE];
+  unsigned char sector[4];
   unsigned type;
   unsigned num;
+  int flags;
   fseek(in, 0, SEEK_END);
   resetcounter(ftell(in));
   fseek(in, 0, SEEK_SET);
-  if ((fgetc(in) != 'E') || (fgetc(in) != 'C') || (fgetc(in) != 'M') ||
-      (fgetc(in) != 0x00)) {
+  if ((fgetc(in) != 'E') || (fgetc(in) != 'C') || (fgetc(in) != 'M')) {
     fprintf(stderr, "Header not found!\n");
     goto corrupt;
   }
+  flags = fgetc(in);
+  if ((flags == EOF) || (flags & ~(ECM_FLAG_FRAMED | ECM_FLAG_STORE))) {
+    fprintf(stderr, "Unsupported ECM file (flags %02X)\n", flags);
+    goto corrupt;
+  }
+  decode_refs = flags & ECM_FLAG_STORE;
+  if (decode_refs && !decode_store) {
+    fprintf(stderr, "This file needs its sector store (--store)\n");
+    return 1;
+  }
+  if (ckpt_resume) {
+    fseek(in, 0, SEEK_END);
+    if ((ckpt_resume->flags != (unsigned)flags) ||
+        (ckpt_resume->insize != (uint64_t)ftell(in)) ||
+        !checkpoint_matches(ckpt_resume, in, decode_store)) {
+      fprintf(stderr, "Checkpoint does not match the ECM file or store\n");
+      return 1;
+    }
+    fprintf(stderr, "Resuming at output byte %llu\n",
+            (unsigned long long)ckpt_resume->out);
+    fseek(in, ckpt_resume->in, SEEK_SET);
+    produced = ckpt_resume->out;
+    checkedc = ckpt_resume->edc;
+    ckpt_last = ckpt_resume->out;
+  }
+  if (flags & ECM_FLAG_FRAMED)
+    return unecmify_frames(in, out);
   for (;;) {
-    int c = fgetc(in);
-    int bits = 5;
-    if (c == EOF)
+    if (read_type_count(in, &type, &num))
       goto uneof;
-    type = c & 3;
-    num = (c >> 2) & 0x1F;
-    while (c & 0x80) {
-      c = fgetc(in);
-      if (c == EOF)
-        goto uneof;
-      num |= ((unsigned)(c & 0x7F)) << bits;
-      bits += 7;
-    }
     if (num == 0xFFFFFFFF)
       break;
     num++;
     if (num >= 0x80000000)
       goto corrupt;
-    if (!type) {
-      while (num) {
-        int b = num;
-        if (b > SECTOR_1_SIZE)
-          b = SECTOR_1_SIZE;
-        if (fread(sector, 1, b, in) != b)
-          goto uneof;
-        checkedc = edc_partial_computeblock(checkedc, sector, b);
-        fwrite(sector, 1, b, out);
-        num -= b;
-        setcounter_decode(ftell(in));
-      }
-    } else {
-      while (num--) {
-        memset(sector, 0, sizeof(sector));
-        memset(sector + 1, 0xFF, 10);
-        switch (type) {
-        case 1:
-          sector[0x0F] = 0x01;
-          if (fread(sector + 0x00C, 1, 0x003, in) != 0x003)
-            goto uneof;
-          if (fread(sector + 0x010, 1, 0x800, in) != 0x800)
-            goto uneof;
-          eccedc_generate(sector, 1);
-          checkedc = edc_partial_computeblock(checkedc, sector, SECTOR_1_SIZE);
-          fwrite(sector, SECTOR_1_SIZE, 1, out);
-          setcounter_decode(ftell(in));
-          break;
-        case 2:
-          sector[0x0F] = 0x02;
-          if (fread(sector + 0x014, 1, 0x804, in) != 0x804)
-            goto uneof;
-          sector[0x10] = sector[0x14];
-          sector[0x11] = sector[0x15];
-          sector[0x12] = sector[0x16];
-          sector[0x13] = sector[0x17];
-          eccedc_generate(sector, 2);
-          checkedc = edc_partial_computeblock(checkedc, sector + 0x10, SECTOR_2_SIZE);
-          fwrite(sector + 0x10, SECTOR_2_SIZE, 1, out);
-          setcounter_decode(ftell(in));
-          break;
-        case 3:
-          sector[0x0F] = 0x02;
-          if (fread(sector + 0x014, 1, 0x918, in) != 0x918)
-            goto uneof;
-          sector[0x10] = sector[0x14];
-          sector[0x11] = sector[0x15];
-          sector[0x12] = sector[0x16];
-          sector[0x13] = sector[0x17];
-          eccedc_generate(sector, 3);
-          checkedc = edc_partial_computeblock(checkedc, sector + 0x10, SECTOR_2_SIZE);
-          fwrite(sector + 0x10, SECTOR_2_SIZE, 1, out);
-          setcounter_decode(ftell(in));
-          break;
-        }
-      }
-    }
+    if (decode_run(in, out, type, num, &checkedc, NULL))
+      goto uneof;
+    produced += (uint64_t)num * record_output_size(type);
+    decode_checkpoint(in, out, flags, produced, checkedc, 0);
   }
   if (fread(sector, 1, 4, in) != 4)
     goto uneof;
-  fprintf(stderr, "Decoded %ld bytes -> %ld bytes\n", ftell(in), ftell(out));
+  fprintf(stderr, "Decoded %ld bytes -> %llu bytes\n", ftell(in),
+          (unsigned long long)produced);
+  if (iso_mode) {
+    fprintf(stderr, "Extracted %llu bytes of user data; EDC not checked\n",
+            (unsigned long long)iso_written);
+    return 0;
+  }
   if ((sector[0] != ((checkedc >> 0) & 0xFF)) ||
       (sector[1] != ((checkedc >> 8) & 0xFF)) ||
       (sector[2] != ((checkedc >> 16) & 0xFF)) ||
@@ -188,11 +570,18 @@ corrupt:
 /***************************************************************************/
 
 int main(int argc, char **argv) {
-  FILE *fin, *fout;
+  FILE *fin, *fout = NULL;
   char *infilename;
   char *outfilename;
   char *cuefilename;
   char createcue = 0;
+  const char *datfilename = NULL;
+  const char *storefilename = NULL;
+  unsigned hashes = 0;
+  bool test = false;
+  bool resuming = false;
+  struct checkpoint resume;
+  int r;
 
   fprintf(stderr, "UNECM - Decoder for Error Code Modeler format v1.0\n"
                   "Copyright (C) 2002 Neill Corlett\n\n");
@@ -203,20 +592,77 @@ int main(int argc, char **argv) {
   /*
   ** Check command line
   */
-  if ((argc != 2) && (argc != 3) && (argc != 4)) {
-    fprintf(stderr, "usage: %s [--cue] ecmfile [outputfile]\n", argv[0]);
+  while (argc >= 2) {
+    if (!strcasecmp(argv[1], "--cue")) {
+      createcue = 1;
+    } else if (!strcasecmp(argv[1], "--test")) {
+      test = true;
+    } else if (!strcasecmp(argv[1], "--resume")) {
+      resuming = true;
+    } else if (!strcasecmp(argv[1], "--iso")) {
+      if (!iso_mode)
+        iso_mode = ISO_ZERO;
+    } else if (!strcasecmp(argv[1], "--iso-skip")) {
+      iso_mode = ISO_SKIP;
+    } else if (!strcasecmp(argv[1], "--hash") && (argc >= 3)) {
+      hashes = hash_parse(argv[2]);
+      if (!hashes) {
+        fprintf(stderr, "unknown hash list '%s'\n", argv[2]);
+        return 1;
+      }
+      argv[2] = argv[0];
+      argc--;
+      argv++;
+    } else if (!strcasecmp(argv[1], "--store") && (argc >= 3)) {
+      storefilename = argv[2];
+      argv[2] = argv[0];
+      argc--;
+      argv++;
+    } else if (!strcasecmp(argv[1], "--dat") && (argc >= 3)) {
+      datfilename = argv[2];
+      argv[2] = argv[0];
+      argc--;
+      argv++;
+    } else {
+      break;
+    }
+    argv[1] = argv[0];
+    argc--;
+    argv++;
+  }
+  if ((argc != 2) && (argc != 3)) {
+    fprintf(stderr,
+            "usage: %s [--cue] [--hash crc32,md5,sha1] [--dat datfile] "
+            "[--test] [--iso | --iso-skip] [--store storefile] "
+            "[--resume] ecmfile [outputfile]\n",
+            argv[0]);
     return 1;
   }
   /*
-  ** Get cur generation status
+  ** Checking against a DAT needs every hash it might list, and writes
+  ** nothing unless asked to
   */
-  if (!strcasecmp(argv[1], "--cue")) {
-    createcue = 1;
+  if (datfilename) {
+    hashes = HASH_CRC32 | HASH_MD5 | HASH_SHA1;
+    if (argc != 3)
+      test = true;
+  }
+  if (test || iso_mode)
+    createcue = 0;
+  /* Hashes would miss everything before the checkpoint */
+  if (resuming && (hashes || test || iso_mode)) {
+    fprintf(stderr, "--resume cannot be combined with --hash, --dat, --test "
+                    "or --iso\n");
+    return 1;
+  }
+  if (!image_hash_begin(hashes)) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
   }
   /*
   ** Verify that the input filename is valid
   */
-  infilename = argv[1 + createcue];
+  infilename = argv[1];
   if (strlen(infilename) < 5) {
     fprintf(stderr, "filename '%s' is too short\n", infilename);
     return 1;
@@ -228,16 +674,36 @@ int main(int argc, char **argv) {
   /*
   ** Figure out what the output filename should be
   */
-  if (argc == 3 + createcue) {
-    outfilename = argv[2 + createcue];
+  if (argc == 3) {
+    outfilename = argv[2];
   } else {
     outfilename = malloc(strlen(infilename) - 3);
     if (!outfilename)
       abort();
     memcpy(outfilename, infilename, strlen(infilename) - 4);
     outfilename[strlen(infilename) - 4] = 0;
+    /* game.bin.ecm becomes game.iso */
+    if (iso_mode) {
+      char *dot = strrchr(outfilename, '.');
+      char *name = malloc(strlen(outfilename) + 5);
+      if (!name)
+        abort();
+      if (dot && !strchr(dot, '/'))
+        *dot = 0;
+      sprintf(name, "%s.iso", outfilename);
+      free(outfilename);
+      outfilename = name;
+    }
+  }
+  if (test)
+    fprintf(stderr, "Testing %s.\n", infilename);
+  else
+    fprintf(stderr, "Decoding %s to %s.\n", infilename, outfilename);
+  if (storefilename) {
+    decode_store = store_open_read(storefilename);
+    if (!decode_store)
+      return 1;
   }
-  fprintf(stderr, "Decoding %s to %s.\n", infilename, outfilename);
   /*
   ** Open both files
   */
@@ -246,21 +712,60 @@ int main(int argc, char **argv) {
     perror(infilename);
     return 1;
   }
-  fout = fopen(outfilename, "wb");
-  if (!fout) {
-    perror(outfilename);
-    fclose(fin);
-    return 1;
+  /* Small records that follow each other come in with one read */
+  setvbuf(fin, NULL, _IOFBF, DECODE_READAHEAD);
+  if (resuming) {
+    if (!checkpoint_load(outfilename, &resume)) {
+      fclose(fin);
+      return 1;
+    }
+    fout = fopen(outfilename, "r+b");
+    if (fout && (!file_truncate(fout, resume.out) ||
+                 fseek(fout, resume.out, SEEK_SET))) {
+      fclose(fout);
+      fout = NULL;
+    }
+    if (!fout) {
+      perror(outfilename);
+      fclose(fin);
+      return 1;
+    }
+    ckpt_resume = &resume;
+  } else if (!test) {
+    fout = fopen(outfilename, "wb");
+    if (!fout) {
+      perror(outfilename);
+      fclose(fin);
+      return 1;
+    }
   }
+  /* Cooked output is not checkpointed, it depends on more state */
+  if (!test && !iso_mode)
+    ckpt_output = outfilename;
   /*
   ** Decode
   */
-  unecmify(fin, fout);
+  r = unecmify(fin, fout);
+  decode_flush(fout);
+  if (decode_store)
+    store_close(decode_store);
+  if (hashes) {
+    struct image_digest digest;
+    image_hash_end(&digest);
+    if (!r) {
+      digest_print(stdout, outfilename, &digest);
+      if (datfilename)
+        r = dat_check(datfilename, &digest);
+    }
+  }
   /*
   ** Close everything
   */
-  fclose(fout);
+  if (fout)
+    fclose(fout);
   fclose(fin);
+  if (ckpt_output && !r)
+    checkpoint_remove(outfilename);
   /*
   ** Write cue file
   */
@@ -282,5 +787,5 @@ int main(int argc, char **argv) {
            fout);
     fclose(fout);
   }
-  return 0;
+  return r;
 }